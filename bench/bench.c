@@ -0,0 +1,204 @@
+/* bench.c: microbenchmark driver for xwiilua (see the accompanying Lua
+   scripts for the actual benchmarks)
+
+   Copyright (c) 2026 by agent <agent@local>
+
+   Copying and distribution of this file, with or without modification,
+   are permitted in any medium without royalty provided the copyright
+   notice and this notice are preserved.  This file is offered as-is,
+   without any warranty. */
+
+/* This embeds a Lua interpreter with a counting allocator and runs the
+   given benchmark scripts in it. The scripts load the xwiilua module as
+   usual (run the driver from the directory containing xwiilua.so, or set
+   LUA_CPATH accordingly), usually open a mock device as the event source,
+   and call bench.run for each function to be measured:
+
+   bench.run(name, f, ...)
+
+   calls f with the given arguments bench.iterations times in a row, and
+   repeats this bench.samples times. For each function, the minimum, median,
+   90th and 99th percentile of the time per call (in nsecs) over all samples
+   are printed, along with the number of memory blocks and bytes allocated
+   per call. The function is called directly from C, so the numbers include
+   little more than the cost of a Lua-to-C call on top of the function
+   itself. bench.run also returns these figures as a table with the fields
+   min, p50, p90, p99, allocs and bytes, so that a script can check them,
+   e.g., to make sure that a query reusing its result table doesn't
+   allocate. The driver exits with a nonzero status if any of the scripts
+   fails.
+
+   Usage: bench [-n iterations] [-s samples] script.lua ... */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+// Allocation statistics, updated by the allocator below.
+static struct {
+  size_t allocs; // number of blocks allocated (or grown)
+  size_t bytes; // number of bytes allocated
+} stats;
+
+static void *count_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+  if (nsize == 0) {
+    free(ptr);
+    return NULL;
+  }
+  // osize is the type tag rather than the size if ptr is NULL
+  if (!ptr) {
+    stats.allocs++;
+    stats.bytes += nsize;
+  } else if (nsize > osize) {
+    stats.allocs++;
+    stats.bytes += nsize - osize;
+  }
+  return realloc(ptr, nsize);
+}
+
+static inline double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+// Percentile of a sorted array of samples.
+static inline double percentile(const double *v, int n, double q)
+{
+  return v[(int)(q*(n-1)+0.5)];
+}
+
+static int get_int_field(lua_State *L, int idx, const char *name, int dflt)
+{
+  int n;
+  lua_getfield(L, idx, name);
+  n = (int)luaL_optinteger(L, -1, dflt);
+  lua_pop(L, 1);
+  return n > 0 ? n : dflt;
+}
+
+static void set_num_field(lua_State *L, const char *name, double val)
+{
+  lua_pushnumber(L, val);
+  lua_setfield(L, -2, name);
+}
+
+static int iterations = 10000, samples = 100;
+
+static int l_run(lua_State *L)
+{
+  const char *name = luaL_checkstring(L, 1);
+  int nargs = lua_gettop(L) - 2, niter, nsamples, i, j;
+  size_t allocs, bytes;
+  double *v, calls;
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  lua_getglobal(L, "bench");
+  niter = get_int_field(L, -1, "iterations", iterations);
+  nsamples = get_int_field(L, -1, "samples", samples);
+  lua_pop(L, 1);
+  if (!(v = malloc(nsamples*sizeof(double))))
+    return luaL_error(L, "bench.run: out of memory");
+  luaL_checkstack(L, nargs+1, NULL);
+  // warm up, and start from a clean slate
+  for (i = 0; i < niter; i++) {
+    for (j = 2; j <= nargs+2; j++)
+      lua_pushvalue(L, j);
+    lua_call(L, nargs, 0);
+  }
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  allocs = stats.allocs;
+  bytes = stats.bytes;
+  for (i = 0; i < nsamples; i++) {
+    double t = now_ns();
+    int k;
+    for (k = 0; k < niter; k++) {
+      for (j = 2; j <= nargs+2; j++)
+	lua_pushvalue(L, j);
+      lua_call(L, nargs, 0);
+    }
+    v[i] = (now_ns() - t) / niter;
+  }
+  calls = (double)niter*nsamples;
+  qsort(v, nsamples, sizeof(double), cmp_double);
+  printf("%-28s %9.1f %9.1f %9.1f %9.1f %8.2f %9.1f\n", name,
+	 v[0], percentile(v, nsamples, 0.5), percentile(v, nsamples, 0.9),
+	 percentile(v, nsamples, 0.99),
+	 (stats.allocs-allocs)/calls, (stats.bytes-bytes)/calls);
+  fflush(stdout);
+  lua_createtable(L, 0, 6);
+  set_num_field(L, "min", v[0]);
+  set_num_field(L, "p50", percentile(v, nsamples, 0.5));
+  set_num_field(L, "p90", percentile(v, nsamples, 0.9));
+  set_num_field(L, "p99", percentile(v, nsamples, 0.99));
+  set_num_field(L, "allocs", (stats.allocs-allocs)/calls);
+  set_num_field(L, "bytes", (stats.bytes-bytes)/calls);
+  free(v);
+  return 1;
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "usage: %s [-n iterations] [-s samples] script.lua ...\n",
+	  prog);
+  exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+  lua_State *L;
+  int c, i, ret = 0;
+  while ((c = getopt(argc, argv, "n:s:")) != -1) {
+    switch (c) {
+    case 'n':
+      iterations = atoi(optarg);
+      break;
+    case 's':
+      samples = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind >= argc || iterations <= 0 || samples <= 0)
+    usage(argv[0]);
+  if (!(L = lua_newstate(count_alloc, NULL))) {
+    fprintf(stderr, "bench: cannot create Lua state\n");
+    return 1;
+  }
+  luaL_openlibs(L);
+  lua_createtable(L, 0, 3);
+  lua_pushcfunction(L, l_run);
+  lua_setfield(L, -2, "run");
+  lua_pushinteger(L, iterations);
+  lua_setfield(L, -2, "iterations");
+  lua_pushinteger(L, samples);
+  lua_setfield(L, -2, "samples");
+  lua_setglobal(L, "bench");
+  for (i = optind; i < argc; i++) {
+    printf("# %s (%d x %d calls)\n", argv[i], samples, iterations);
+    printf("%-28s %9s %9s %9s %9s %8s %9s\n", "function",
+	   "min", "p50", "p90", "p99", "allocs", "bytes");
+    fflush(stdout);
+    if (luaL_dofile(L, argv[i])) {
+      fprintf(stderr, "bench: %s\n", lua_tostring(L, -1));
+      lua_pop(L, 1);
+      ret = 1;
+    }
+    printf("\n");
+  }
+  lua_close(L);
+  return ret;
+}
@@ -0,0 +1,34 @@
+-- Event processing benchmarks: the cost of xwii_poll and xwii_poll_all,
+-- including the processing of the motion events, on a mock device which
+-- generates events as fast as they are consumed. Each call processes at
+-- most one batch of events (64 by default), so the figures are per batch.
+
+local xw = require("xwiilua")
+
+local d = xw.xwii_mock{accel = 100, motionplus = 100, ir = 100,
+		       nunchuk = 100, keys = 10, realtime = false}
+local buf = {}
+
+bench.run("xwii_poll", xw.xwii_poll, d)
+bench.run("xwii_poll_all", xw.xwii_poll_all, d, 0, buf)
+
+-- the same with some processing stages enabled
+xw.xwii_fusion(d)
+bench.run("xwii_poll_all (fusion)", xw.xwii_poll_all, d, 0, buf)
+xw.xwii_filter(d, "accel", {{"oneeuro"}})
+xw.xwii_ir_tracking(d)
+bench.run("xwii_poll_all (+filter, ir)", xw.xwii_poll_all, d, 0, buf)
+xw.xwii_history_size(d, "accel", 256)
+xw.xwii_resample(d, "accel", 200)
+bench.run("xwii_poll_all (+hist, rs)", xw.xwii_poll_all, d, 0, buf)
+xw.xwii_latency(d)
+bench.run("xwii_poll_all (+latency)", xw.xwii_poll_all, d, 0, buf)
+xw.xwii_close(d)
+
+-- a key storm: key events only, each of which is reported
+d = xw.xwii_mock{accel = 0, keys = 1000, realtime = false}
+bench.run("xwii_poll (keys)", xw.xwii_poll, d)
+local r = bench.run("xwii_poll_all (keys)", xw.xwii_poll_all, d, 0, buf)
+-- reusing the result table, this must not generate any garbage
+assert(r.allocs == 0, "xwii_poll_all allocates with a reused table")
+xw.xwii_close(d)
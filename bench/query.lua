@@ -0,0 +1,43 @@
+-- Query benchmarks: the cost of the functions returning the current motion
+-- data, both with a new result table in each call and with a table which is
+-- reused (the latter must not allocate anything). The data comes from a
+-- mock device which generates all kinds of events supported by the mock.
+
+local xw = require("xwiilua")
+
+local d = xw.xwii_mock{accel = 100, motionplus = 100, ir = 100,
+		       nunchuk = 100, board = 100, realtime = false}
+xw.xwii_fusion(d)
+xw.xwii_ir_tracking(d)
+xw.xwii_history_size(d, "accel", 256)
+-- get some data
+for i = 1, 100 do
+   xw.xwii_poll_all(d)
+end
+
+local queries = {
+   "xwii_accel", "xwii_ir", "xwii_motion_plus", "xwii_nunchuk_accel",
+   "xwii_nunchuk_stick", "xwii_board", "xwii_balance", "xwii_orientation",
+   "xwii_pointer"
+}
+
+for _, name in ipairs(queries) do
+   local f, buf = xw[name], {}
+   assert(f(d), name .. " returns no data")
+   bench.run(name, f, d)
+   local r = bench.run(name .. " (reuse)", f, d, buf)
+   assert(r.allocs == 0, name .. " allocates with a reused table")
+end
+
+local all = 0
+for _, bit in pairs(xw.xwii_sensors) do
+   all = all | bit
+end
+local buf = {}
+bench.run("xwii_snapshot", xw.xwii_snapshot, d, all)
+local r = bench.run("xwii_snapshot (reuse)", xw.xwii_snapshot, d, all, buf)
+assert(r.allocs == 0, "xwii_snapshot allocates with a reused table")
+bench.run("xwii_history", xw.xwii_history, d, "accel", 0, buf)
+bench.run("xwii_age", xw.xwii_age, d)
+bench.run("xwii_time", xw.xwii_time)
+xw.xwii_close(d)
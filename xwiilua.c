@@ -10,9 +10,11 @@
 
 /* This presents a simplified version of the xwiimote interface
    (http://dvdhrm.github.io/xwiimote/) optimized for an interpreted language
-   like Lua. Devices are identified using handles (1-based indices into the
-   devices table); a function to return the known devices as a Lua table is
-   provided. The devices, once opened, can be polled for key events, which
+   like Lua. Devices are opened by their (1-based) index in the table of
+   known devices, which can be retrieved with a function provided for that
+   purpose. Open devices are identified by handles, which are Lua objects
+   carrying all per-device state, with the functions operating on them
+   available as methods. The devices, once opened, can be polled for key events, which
    also keeps track of the various kinds of motion events. The Wiimote can
    generate a *lot* of motion events, reporting every single event isn't
    really practical in Lua, so we provide functions to read the current motion
@@ -23,9 +25,9 @@
    libxwiimote, but note that at present only the core Wiimote input devices
    (accelerometer and IR tracker), the Motion-Plus gyroscope and the Nunchuk
    have actually been tested. This matches the Wii Remote Plus with an
-   attached Nunchuk, which is the configuration I have and can test. XXXTODO:
-   guitar and drum movement events haven't been implemented yet, but should be
-   easy to add if anyone needs them. If you notice any bugs or can contribute
+   attached Nunchuk, which is the configuration I have and can test. The
+   guitar and drum movement events are decoded as well, but haven't been
+   tested with real hardware yet. If you notice any bugs or can contribute
    code to better support the Guitar and Drum Controllers, please let me know
    or send me a pull request at Github. */
 
@@ -36,6 +38,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <math.h>
+#include <stddef.h>
 
 #include <xwiimote.h>
 
@@ -43,499 +56,5310 @@
 #include <lauxlib.h>
 #include <lualib.h>
 
-// We support a maximum of NDEV different devices right now. Each open device
-// has a corresponding handle in the range 1..NDEV.
-#define NDEV 10
+// Size of the per-device event queue filled by the background reader thread
+// (see below). This must be a power of 2.
+#define RINGSIZE 1024
 
+// Single-producer/single-consumer event queue. head is only written by the
+// reader thread, tail only by the thread calling xwii_poll, so no locks are
+// needed. The padding keeps the two counters in separate cache lines.
 typedef struct {
-  struct xwii_iface *iface; // xwiimote iface descriptor
-  int fds_num; // number of file descriptors (1 if open, 0 otherwise)
-  struct pollfd fds[1]; // file descriptor used to poll the device
-  // movement data (pro stores movement data for both the classic and pro
-  // controllers)
-  struct xwii_event_abs accel, motion, nunchuk_accel, nunchuk_stick,
-    ir[4], pro[2], board[4];
-} devhandle;
+  atomic_uint head; char pad1[64];
+  atomic_uint tail; char pad2[64];
+  atomic_int waiting; // set while xwii_wait is sleeping on the notify fd
+  atomic_uint dropped; // number of events dropped because the queue was full
+  unsigned reported; // number of dropped events reported so far
+  int notify; // eventfd used to wake up a waiting consumer
+  struct xwii_event buf[RINGSIZE];
+} evring;
 
-static devhandle devh[NDEV];
+// The different kinds of motion data we keep track of. The names are used to
+// refer to these in the Lua interface; they are the same as the
+// corresponding messages of the Pd object.
+enum {
+  SENSOR_ACCEL, SENSOR_IR, SENSOR_MOTION_PLUS, SENSOR_NUNCHUK_ACCEL,
+  SENSOR_NUNCHUK_STICK, SENSOR_PRO, SENSOR_BOARD, SENSOR_CLASSIC, NSENSORS
+};
 
-// Return a table with the names of the devices known to the system. (Note
-// that this will report all devices connected to the system, but only the
-// first NDEV of these will actually be accessible using the routines provided
-// below.)
-static int l_xwii_list(lua_State *L)
+static const char *const sensor_names[] = {
+  "accel", "ir", "motionplus", "ncaccel", "ncstick", "prostick", "board",
+  "classic", NULL
+};
+
+// The interface which needs to be open for each sensor.
+static const unsigned sensor_iface[] = {
+  XWII_IFACE_CORE, XWII_IFACE_CORE, XWII_IFACE_MOTION_PLUS, XWII_IFACE_NUNCHUK,
+  XWII_IFACE_NUNCHUK, XWII_IFACE_PRO_CONTROLLER, XWII_IFACE_BALANCE_BOARD,
+  XWII_IFACE_CLASSIC_CONTROLLER
+};
+
+// The number of values reported for each sensor.
+static const int sensor_nvals[] = { 3, 8, 3, 3, 2, 4, 4, 6 };
+
+// The number of values in each x, y, z vector (the remaining values of the
+// sensor are given by sensor_nvals[i]/sensor_dim[i] vectors).
+static const int sensor_dim[] = { 3, 2, 3, 3, 2, 2, 1, 2 };
+
+// Motion history. For the sensors which report a single x, y, z triple
+// (accelerometer, Motion-Plus and the Nunchuk), all samples can also be
+// recorded in a ring buffer, so that the application doesn't lose any data
+// between queries. The buffer is kept as a structure of arrays, and the
+// total number of samples recorded so far serves as a cursor, so that an
+// application can fetch all samples since its previous query.
+typedef struct {
+  unsigned size; // capacity (a power of 2), 0 if history is disabled
+  uint64_t count; // total number of samples recorded so far
+  uint64_t first; // index of the first sample in the current buffer
+  int64_t *t; // timestamps
+  int32_t *x, *y, *z; // sample data
+} history;
+
+// The sensors for which history is available:
+static inline int has_history(int sensor)
 {
-  struct xwii_monitor *mon;
-  char *ent;
-  int i = 0;
+  return sensor == SENSOR_ACCEL || sensor == SENSOR_MOTION_PLUS ||
+    sensor == SENSOR_NUNCHUK_ACCEL || sensor == SENSOR_NUNCHUK_STICK;
+}
 
-  mon = xwii_monitor_new(false, false);
-  if (!mon) {
-    fprintf(stderr, "xwii_list: cannot create monitor\n");
+static void history_free(history *h)
+{
+  free(h->t);
+  memset(h, 0, sizeof(*h));
+}
+
+// Resize the history buffer (the size gets rounded up to the next power of
+// 2; 0 disables the history). This discards all samples recorded so far but
+// keeps the sample count, so that existing cursors remain valid. Returns the
+// new size, or -1 if we're out of memory.
+static int history_resize(history *h, unsigned size)
+{
+  unsigned n = 1;
+  uint64_t count = h->count;
+  char *buf;
+  if (size == 0) {
+    history_free(h);
+    h->count = h->first = count;
     return 0;
   }
+  while (n < size) n <<= 1;
+  if (n == h->size) return n;
+  buf = malloc((size_t)n * (sizeof(int64_t) + 3*sizeof(int32_t)));
+  if (!buf) return -1;
+  history_free(h);
+  h->size = n;
+  h->count = h->first = count;
+  h->t = (int64_t*)buf;
+  h->x = (int32_t*)(buf + n*sizeof(int64_t));
+  h->y = h->x + n;
+  h->z = h->y + n;
+  return n;
+}
 
-  lua_newtable(L);
-  while ((ent = xwii_monitor_poll(mon))) {
-    lua_pushinteger(L, ++i);
-    lua_pushstring(L, ent);
-    lua_settable(L, -3);
-    free(ent);
+static inline void history_add(history *h, const struct xwii_event_abs *abs,
+			       int64_t t)
+{
+  if (h->size) {
+    unsigned i = h->count & (h->size-1);
+    h->t[i] = t;
+    h->x[i] = abs->x;
+    h->y[i] = abs->y;
+    h->z[i] = abs->z;
+  }
+  h->count++;
+}
+
+// Sensor fusion. If enabled, the accelerometer and Motion-Plus data are fed
+// into an orientation filter (Madgwick's gradient descent algorithm, IMU
+// variant) at the full event rate, which yields the orientation of the
+// Wiimote as a quaternion. The gyroscope data is integrated over time, while
+// the direction of gravity reported by the accelerometer is used to correct
+// the drift in pitch and roll; yaw will still drift slowly, there's no
+// reference for it. Without Motion-Plus, only the accelerometer is used,
+// which gives pitch and roll but no yaw.
+
+// Nominal Motion-Plus scale factor (degrees/sec per unit of the values
+// reported by the kernel driver). This is only approximate, the actual value
+// depends on the device and the mode the gyroscope is in.
+#define GYRO_SCALE (1.0f/167.0f)
+#define DEG2RAD 0.017453292519943295f
+#define RAD2DEG 57.29577951308232f
+
+typedef struct {
+  int enabled;
+  float beta; // filter gain (larger values trust the accelerometer more)
+  float gyro_scale; // degrees/sec per unit of the gyroscope data
+  float q[4]; // orientation quaternion (w, x, y, z)
+  float a[3]; // most recent accelerometer data
+  int64_t last; // timestamp of the last update
+  int64_t stamp; // timestamp of the most recent data
+} fusion;
+
+static void fusion_reset(fusion *f)
+{
+  f->q[0] = 1.0f;
+  f->q[1] = f->q[2] = f->q[3] = 0.0f;
+  f->a[0] = f->a[1] = f->a[2] = 0.0f;
+  f->last = f->stamp = 0;
+}
+
+// One step of Madgwick's IMU filter, with the angular rates g (rad/s), the
+// acceleration a (any scale) and the time step dt (secs).
+static void fusion_step(fusion *f, const float g[3], const float a[3],
+			float dt)
+{
+  float q0 = f->q[0], q1 = f->q[1], q2 = f->q[2], q3 = f->q[3];
+  float ax = a[0], ay = a[1], az = a[2], norm;
+  // rate of change of the quaternion from the gyroscope
+  float qd0 = 0.5f * (-q1*g[0] - q2*g[1] - q3*g[2]);
+  float qd1 = 0.5f * (q0*g[0] + q2*g[2] - q3*g[1]);
+  float qd2 = 0.5f * (q0*g[1] - q1*g[2] + q3*g[0]);
+  float qd3 = 0.5f * (q0*g[2] + q1*g[1] - q2*g[0]);
+  norm = ax*ax + ay*ay + az*az;
+  if (norm > 0.0f) {
+    // corrective step along the gradient of the error between the measured
+    // and the estimated direction of gravity
+    float s0, s1, s2, s3;
+    float q0q0 = q0*q0, q1q1 = q1*q1, q2q2 = q2*q2, q3q3 = q3*q3;
+    norm = 1.0f/sqrtf(norm);
+    ax *= norm; ay *= norm; az *= norm;
+    s0 = 4.0f*q0*q2q2 + 2.0f*q2*ax + 4.0f*q0*q1q1 - 2.0f*q1*ay;
+    s1 = 4.0f*q1*q3q3 - 2.0f*q3*ax + 4.0f*q0q0*q1 - 2.0f*q0*ay - 4.0f*q1 +
+      8.0f*q1*q1q1 + 8.0f*q1*q2q2 + 4.0f*q1*az;
+    s2 = 4.0f*q0q0*q2 + 2.0f*q0*ax + 4.0f*q2*q3q3 - 2.0f*q3*ay - 4.0f*q2 +
+      8.0f*q2*q1q1 + 8.0f*q2*q2q2 + 4.0f*q2*az;
+    s3 = 4.0f*q1q1*q3 - 2.0f*q1*ax + 4.0f*q2q2*q3 - 2.0f*q2*ay;
+    norm = s0*s0 + s1*s1 + s2*s2 + s3*s3;
+    if (norm > 0.0f) {
+      norm = f->beta/sqrtf(norm);
+      qd0 -= norm*s0; qd1 -= norm*s1; qd2 -= norm*s2; qd3 -= norm*s3;
+    }
+  }
+  q0 += qd0*dt; q1 += qd1*dt; q2 += qd2*dt; q3 += qd3*dt;
+  norm = 1.0f/sqrtf(q0*q0 + q1*q1 + q2*q2 + q3*q3);
+  f->q[0] = q0*norm; f->q[1] = q1*norm; f->q[2] = q2*norm; f->q[3] = q3*norm;
+}
+
+// Time step in secs since the last update. We clamp this to 0.1 secs, so
+// that gaps in the data (e.g., after the filter was enabled, or when the
+// device was out of range) don't throw off the filter.
+static inline float fusion_dt(fusion *f, int64_t t)
+{
+  float dt = f->last ? (t - f->last)*1e-6f : 0.0f;
+  f->last = t;
+  return dt < 0.0f ? 0.0f : dt > 0.1f ? 0.1f : dt;
+}
+
+// Feed accelerometer data into the filter. This only updates the orientation
+// if we don't have a gyroscope, otherwise the data is used in the next
+// gyroscope update.
+static void fusion_accel(fusion *f, const struct xwii_event_abs *abs,
+			 int64_t t, int have_gyro)
+{
+  static const float zero[3] = { 0.0f, 0.0f, 0.0f };
+  f->a[0] = abs->x; f->a[1] = abs->y; f->a[2] = abs->z;
+  if (!have_gyro) {
+    fusion_step(f, zero, f->a, fusion_dt(f, t));
+    f->stamp = t;
+  }
+}
+
+// Feed Motion-Plus data into the filter. The gyroscope axes are ordered
+// yaw, roll, pitch in the Motion-Plus reports, i.e., they are the rotations
+// about the z, y and x axes of the accelerometer, respectively.
+static void fusion_gyro(fusion *f, const struct xwii_event_abs *abs,
+			int64_t t)
+{
+  float k = f->gyro_scale*DEG2RAD, g[3];
+  g[0] = abs->z*k; g[1] = abs->y*k; g[2] = abs->x*k;
+  fusion_step(f, g, f->a, fusion_dt(f, t));
+  f->stamp = t;
+}
+
+// Calibration. If enabled, the raw sensor data is corrected before it is
+// stored, so that all queries, the history and sensor fusion get calibrated
+// values. The Motion-Plus zero-rate offset is subtracted, the accelerometer
+// data is scaled so that 1g = 1000, and the Nunchuk stick is centered and
+// scaled to a range of -100..100. In learning mode (the default) these
+// parameters are estimated while the device is in use: the gyroscope offset
+// and the accelerometer scale are taken whenever the device is at rest for a
+// while, and the stick centre and range are learned from the stick positions
+// seen so far. The parameters can be saved to a file, so that they don't need
+// to be learned again in the next session.
+
+#define CAL_GYRO		0x01
+#define CAL_ACCEL		0x02
+#define CAL_NUNCHUK_ACCEL	0x04
+#define CAL_STICK		0x08
+
+#define RESTWIN 64 // number of samples for rest detection
+#define ONE_G 1000 // calibrated accelerometer value for 1g
+#define STICK_RANGE 100 // calibrated stick range
+
+// Rest detection: a window of samples which all lie within a given tolerance
+// of each other on each axis.
+typedef struct {
+  int n;
+  int32_t min[3], max[3];
+  int64_t sum[3];
+} restwin;
+
+// Add a sample to the window. Returns 1 and the mean of the samples if the
+// window is full, 0 otherwise.
+static int restwin_add(restwin *w, const struct xwii_event_abs *a, int tol,
+		       float mean[3])
+{
+  int32_t v[3] = { a->x, a->y, a->z };
+  int i, restart = w->n == 0;
+  for (i = 0; i < 3 && !restart; i++)
+    restart = (v[i] > w->max[i] ? v[i] : w->max[i]) -
+      (v[i] < w->min[i] ? v[i] : w->min[i]) > tol;
+  if (restart) {
+    // out of tolerance, start a new window with this sample
+    for (i = 0; i < 3; i++)
+      w->min[i] = w->max[i] = w->sum[i] = v[i];
+    w->n = 1;
+    return 0;
+  }
+  for (i = 0; i < 3; i++) {
+    if (v[i] < w->min[i]) w->min[i] = v[i];
+    if (v[i] > w->max[i]) w->max[i] = v[i];
+    w->sum[i] += v[i];
+  }
+  if (++w->n < RESTWIN) return 0;
+  for (i = 0; i < 3; i++)
+    mean[i] = (float)w->sum[i]/w->n;
+  w->n = 0;
+  return 1;
+}
+
+typedef struct {
+  float c[2]; // centre
+  int32_t lo[2], hi[2]; // range seen so far, relative to the centre
+  restwin win;
+} stickcal;
+
+typedef struct {
+  int enabled; // apply the calibration
+  int learn; // learn the parameters on the fly
+  int gyro_tol, accel_tol; // tolerances for rest detection
+  int valid; // parameters which are known (CAL_* bitmask)
+  float gbias[3]; // gyroscope zero-rate offset
+  float ascale, nascale; // accelerometer scale factors (Wiimote, Nunchuk)
+  stickcal stick; // Nunchuk stick
+  restwin gwin, awin, nwin; // rest detection (gyro, accel, Nunchuk accel)
+} calib;
+
+static void calib_reset(calib *c)
+{
+  memset(&c->valid, 0, sizeof(*c) - offsetof(calib, valid));
+}
+
+static void calib_gyro(calib *c, struct xwii_event_abs *a)
+{
+  float m[3];
+  if (c->learn && restwin_add(&c->gwin, a, c->gyro_tol, m)) {
+    memcpy(c->gbias, m, sizeof(m));
+    c->valid |= CAL_GYRO;
+  }
+  if (c->valid & CAL_GYRO) {
+    a->x = lrintf(a->x - c->gbias[0]);
+    a->y = lrintf(a->y - c->gbias[1]);
+    a->z = lrintf(a->z - c->gbias[2]);
+  }
+}
+
+// At rest, the accelerometer only measures gravity, so the magnitude of the
+// acceleration gives us the scale factor.
+static void calib_accel(calib *c, restwin *w, float *scale, int flag,
+			struct xwii_event_abs *a)
+{
+  float m[3], g;
+  if (c->learn && restwin_add(w, a, c->accel_tol, m) &&
+      (g = sqrtf(m[0]*m[0] + m[1]*m[1] + m[2]*m[2])) > 0.0f) {
+    *scale = ONE_G/g;
+    c->valid |= flag;
+  }
+  if (c->valid & flag) {
+    a->x = lrintf(a->x * *scale);
+    a->y = lrintf(a->y * *scale);
+    a->z = lrintf(a->z * *scale);
+  }
+}
+
+static inline int32_t stick_scale(int32_t v, int32_t r)
+{
+  // use the nominal range until we have seen a reasonable part of it
+  if (r < STICK_RANGE/4) r = STICK_RANGE;
+  v = v*STICK_RANGE/r;
+  return v > STICK_RANGE ? STICK_RANGE : v < -STICK_RANGE ? -STICK_RANGE : v;
+}
+
+static void calib_stick(calib *c, struct xwii_event_abs *a)
+{
+  stickcal *s = &c->stick;
+  int32_t v[2];
+  float m[3];
+  int i;
+  if (c->learn && restwin_add(&s->win, a, 2, m) &&
+      fabsf(m[0] - s->c[0]) < STICK_RANGE/4 &&
+      fabsf(m[1] - s->c[1]) < STICK_RANGE/4) {
+    // the stick has been resting near the centre, take this as the new centre
+    s->c[0] = m[0];
+    s->c[1] = m[1];
+    c->valid |= CAL_STICK;
+  }
+  v[0] = lrintf(a->x - s->c[0]);
+  v[1] = lrintf(a->y - s->c[1]);
+  for (i = 0; i < 2; i++) {
+    if (c->learn) {
+      if (v[i] < s->lo[i]) s->lo[i] = v[i];
+      if (v[i] > s->hi[i]) s->hi[i] = v[i];
+    }
+    v[i] = v[i] < 0 ? -stick_scale(-v[i], -s->lo[i]) :
+      stick_scale(v[i], s->hi[i]);
+  }
+  a->x = v[0];
+  a->y = v[1];
+}
+
+// Filter chains. Each sensor can have a chain of up to MAXSTAGES filter
+// stages which are applied to the data in the event drain, i.e., at the full
+// event rate, so the queries return the filtered values. Available filters
+// are: exponential moving average (ema), biquad low-pass (lowpass), the
+// One-Euro filter (oneeuro) which adapts its cutoff frequency to the speed of
+// the motion, and median-of-N (median) which is good at removing spikes. The
+// filtered values are rounded to integers when stored, so filtering works
+// best with calibrated data (see above), which has a higher resolution.
+
+#define MAXSTAGES 4 // max number of stages per sensor
+#define MAXCHANS 8 // max number of values per sensor
+#define MAXMEDIAN 9 // max window size of the median filter
+#define NOMINAL_RATE 100.0f // nominal event rate (Hz)
+
+enum { FILTER_EMA, FILTER_LOWPASS, FILTER_ONEEURO, FILTER_MEDIAN };
+
+static const char *const filter_names[] = {
+  "ema", "lowpass", "oneeuro", "median", NULL
+};
+
+typedef struct {
+  int type;
+  float p[3]; // parameters
+  float c[5]; // biquad coefficients (b0, b1, b2, a1, a2)
+  int n, k; // median window size and current position
+  // per-channel state (biquad: x1, x2, y1, y2 in s[0..3], median: window)
+  float y[MAXCHANS], dy[MAXCHANS];
+  float s[MAXMEDIAN][MAXCHANS];
+} filterstage;
+
+typedef struct {
+  int nstages;
+  unsigned init; // channels with initialized state (bitmask)
+  int64_t last; // time of the previous sample
+  filterstage st[MAXSTAGES];
+} filterchain;
+
+// Initialize a filter stage with the given parameters (NaN = default).
+// Returns an error message if the parameters are invalid, NULL otherwise.
+static const char *filter_setup(filterstage *f, int type, const float p[3])
+{
+  static const float defaults[][3] = {
+    { 0.5f, 0.0f, 0.0f }, // ema: alpha
+    { 10.0f, 0.7071f, NOMINAL_RATE }, // lowpass: cutoff, q, rate
+    { 1.0f, 0.007f, 1.0f }, // oneeuro: mincutoff, beta, dcutoff
+    { 3.0f, 0.0f, 0.0f }, // median: n
+  };
+  int i;
+  memset(f, 0, sizeof(*f));
+  f->type = type;
+  for (i = 0; i < 3; i++)
+    f->p[i] = isnan(p[i]) ? defaults[type][i] : p[i];
+  switch (type) {
+  case FILTER_EMA:
+    if (!(f->p[0] > 0.0f && f->p[0] <= 1.0f))
+      return "ema: alpha must be in the range (0, 1]";
+    break;
+  case FILTER_LOWPASS:
+    {
+      // RBJ cookbook low-pass biquad
+      float w0, alpha, cs, a0;
+      if (!(f->p[2] > 0.0f && f->p[0] > 0.0f && f->p[0] < f->p[2]/2))
+	return "lowpass: cutoff must be between 0 and half the rate";
+      if (!(f->p[1] > 0.0f))
+	return "lowpass: q must be positive";
+      w0 = 2.0f*(float)M_PI*f->p[0]/f->p[2];
+      cs = cosf(w0);
+      alpha = sinf(w0)/(2.0f*f->p[1]);
+      a0 = 1.0f + alpha;
+      f->c[0] = f->c[2] = (1.0f - cs)/2.0f/a0;
+      f->c[1] = (1.0f - cs)/a0;
+      f->c[3] = -2.0f*cs/a0;
+      f->c[4] = (1.0f - alpha)/a0;
+      break;
+    }
+  case FILTER_ONEEURO:
+    if (!(f->p[0] > 0.0f && f->p[1] >= 0.0f && f->p[2] > 0.0f))
+      return "oneeuro: invalid parameters";
+    break;
+  case FILTER_MEDIAN:
+    if (!(f->p[0] >= 1.0f && f->p[0] <= MAXMEDIAN))
+      return "median: window size must be between 1 and 9";
+    f->n = (int)f->p[0];
+    break;
+  }
+  return NULL;
+}
+
+// Smoothing factor of a first-order low-pass with the given cutoff frequency
+// (Hz) and time step (secs), as used by the One-Euro filter.
+static inline float oneeuro_alpha(float cutoff, float dt)
+{
+  float tau = 1.0f/(2.0f*(float)M_PI*cutoff);
+  return 1.0f/(1.0f + tau/dt);
+}
+
+// Run a single channel through a filter stage. If init is set, the state of
+// the channel is (re)initialized from the sample.
+static float filter_stage(filterstage *f, int i, float x, float dt, int init)
+{
+  switch (f->type) {
+  case FILTER_EMA:
+    if (init)
+      f->y[i] = x;
+    else
+      f->y[i] += f->p[0]*(x - f->y[i]);
+    return f->y[i];
+  case FILTER_LOWPASS:
+    {
+      const float *c = f->c;
+      float y;
+      if (init)
+	f->s[0][i] = f->s[1][i] = f->s[2][i] = f->s[3][i] = x;
+      y = c[0]*x + c[1]*f->s[0][i] + c[2]*f->s[1][i] -
+	c[3]*f->s[2][i] - c[4]*f->s[3][i];
+      f->s[1][i] = f->s[0][i];
+      f->s[0][i] = x;
+      f->s[3][i] = f->s[2][i];
+      f->s[2][i] = y;
+      return y;
+    }
+  case FILTER_ONEEURO:
+    if (init) {
+      f->y[i] = x;
+      f->dy[i] = 0.0f;
+    } else {
+      float dx = (x - f->y[i])/dt;
+      f->dy[i] += oneeuro_alpha(f->p[2], dt)*(dx - f->dy[i]);
+      f->y[i] += oneeuro_alpha(f->p[0] + f->p[1]*fabsf(f->dy[i]), dt)*
+	(x - f->y[i]);
+    }
+    return f->y[i];
+  case FILTER_MEDIAN:
+    {
+      float w[MAXMEDIAN];
+      int j, k;
+      if (init)
+	for (j = 0; j < f->n; j++)
+	  f->s[j][i] = x;
+      else
+	f->s[f->k][i] = x;
+      // insertion sort, the window is tiny
+      for (j = 0; j < f->n; j++) {
+	float v = f->s[j][i];
+	for (k = j; k > 0 && w[k-1] > v; k--)
+	  w[k] = w[k-1];
+	w[k] = v;
+      }
+      return w[f->n/2];
+    }
+  }
+  return x;
+}
+
+static inline float abs_get(const struct xwii_event_abs *a, int k)
+{
+  return k == 0 ? a->x : k == 1 ? a->y : a->z;
+}
+
+static inline void abs_set(struct xwii_event_abs *a, int k, float v)
+{
+  int32_t x = lrintf(v);
+  if (k == 0) a->x = x; else if (k == 1) a->y = x; else a->z = x;
+}
+
+// Run the filter chain of a sensor on n vectors of the given dimension. For
+// IR data, invalid points (1023) are passed through unchanged and restart
+// the filters of the corresponding channels.
+static void filter_run(filterchain *fc, struct xwii_event_abs *a, int n,
+		       int dim, int64_t t, int ir)
+{
+  float dt = fc->last && t > fc->last ? (t - fc->last)*1e-6f :
+    1.0f/NOMINAL_RATE;
+  int i, j, k, s;
+  fc->last = t;
+  for (j = 0, i = 0; j < n; j++) {
+    int valid = !ir || (a[j].x != 1023 && a[j].y != 1023);
+    for (k = 0; k < dim; k++, i++) {
+      unsigned bit = 1u << i;
+      float x;
+      if (!valid) {
+	fc->init &= ~bit;
+	continue;
+      }
+      x = abs_get(&a[j], k);
+      for (s = 0; s < fc->nstages; s++)
+	x = filter_stage(&fc->st[s], i, x, dt, !(fc->init & bit));
+      fc->init |= bit;
+      abs_set(&a[j], k, x);
+    }
+  }
+  for (s = 0; s < fc->nstages; s++)
+    if (fc->st[s].type == FILTER_MEDIAN)
+      fc->st[s].k = (fc->st[s].k + 1) % fc->st[s].n;
+}
+
+// IR pointer. The IR camera reports up to four bright spots in a 1024x768
+// image. If pointer tracking is enabled, we identify the two dots of the
+// sensor bar in each frame and compute the pointer position on the screen,
+// the distance to the sensor bar, and the roll angle of the Wiimote. The
+// dots are matched against the pair from the previous frame, so stray light
+// sources don't make the pointer jump around, and if one of the dots is
+// lost, its position is estimated from the other one. Normally the dots are
+// ordered left to right in the image, which limits roll to +/-90 degrees.
+// Optionally, the accelerometer can be used to tell the dots apart, so that
+// the Wiimote may be rolled all the way around; the accelerometer then also
+// provides the roll angle if no dots are visible.
+
+#define IR_WIDTH 1024.0f
+#define IR_HEIGHT 768.0f
+#define IR_FOCAL 1320.0f // approximate focal length of the camera (pixels)
+
+typedef struct {
+  int enabled;
+  int use_accel; // use the accelerometer to determine roll
+  float bar; // width of the sensor bar (determines the unit of distance)
+  int have_pair; // whether we have a pair of dots to track
+  float dot[2][2]; // the tracked dots (left, right) in camera coordinates
+  int ndots; // number of dots seen in the last frame (0-2)
+  float x, y, dist, roll; // pointer state
+  int64_t stamp;
+} irpointer;
+
+static inline float dot_dist(const float a[2], const float b[2])
+{
+  return fabsf(a[0] - b[0]) + fabsf(a[1] - b[1]);
+}
+
+// Difference between two angles, wrapped to the range -pi..pi.
+static inline float angle_diff(float a, float b)
+{
+  float d = fmodf(a - b, 2.0f*(float)M_PI);
+  if (d > (float)M_PI) d -= 2.0f*(float)M_PI;
+  else if (d < -(float)M_PI) d += 2.0f*(float)M_PI;
+  return d;
+}
+
+static void pointer_update(irpointer *p, const struct xwii_event_abs ir[4],
+			   const struct xwii_event_abs *accel, int64_t t)
+{
+  float pt[4][2], aroll = NAN, phi, dx, dy, sep, mx, my, cs, sn;
+  int i, j, n = 0;
+  for (i = 0; i < 4; i++)
+    if (ir[i].x != 1023 && ir[i].y != 1023) {
+      pt[n][0] = ir[i].x;
+      pt[n][1] = ir[i].y;
+      n++;
+    }
+  if (p->use_accel && (accel->x || accel->z))
+    // image angle of the sensor bar implied by the direction of gravity
+    aroll = atan2f(accel->x, accel->z);
+  if (n >= 2) {
+    // pick the pair of dots which best matches the previous frame
+    int a = 0, b = 1;
+    if (p->have_pair && n > 2) {
+      float best = INFINITY;
+      for (i = 0; i < n; i++)
+	for (j = i+1; j < n; j++) {
+	  float d1 = dot_dist(pt[i], p->dot[0]) + dot_dist(pt[j], p->dot[1]);
+	  float d2 = dot_dist(pt[i], p->dot[1]) + dot_dist(pt[j], p->dot[0]);
+	  float d = d1 < d2 ? d1 : d2;
+	  if (d < best) {
+	    best = d;
+	    a = i; b = j;
+	  }
+	}
+    }
+    // order the dots left to right
+    if (isnan(aroll) ? pt[b][0] < pt[a][0] :
+	fabsf(angle_diff(atan2f(pt[b][1] - pt[a][1], pt[b][0] - pt[a][0]),
+			 aroll)) > (float)M_PI/2) {
+      i = a; a = b; b = i;
+    }
+    memcpy(p->dot[0], pt[a], sizeof(pt[a]));
+    memcpy(p->dot[1], pt[b], sizeof(pt[b]));
+    p->have_pair = 1;
+    p->ndots = 2;
+  } else if (n == 1 && p->have_pair) {
+    // move the pair along with the dot we still see
+    int k = dot_dist(pt[0], p->dot[0]) > dot_dist(pt[0], p->dot[1]);
+    dx = pt[0][0] - p->dot[k][0];
+    dy = pt[0][1] - p->dot[k][1];
+    for (i = 0; i < 2; i++) {
+      p->dot[i][0] += dx;
+      p->dot[i][1] += dy;
+    }
+    p->ndots = 1;
+  } else {
+    p->have_pair = 0;
+    p->ndots = 0;
+    if (!isnan(aroll)) {
+      p->roll = -aroll*RAD2DEG;
+      p->stamp = t;
+    }
+    return;
+  }
+  dx = p->dot[1][0] - p->dot[0][0];
+  dy = p->dot[1][1] - p->dot[0][1];
+  phi = atan2f(dy, dx);
+  sep = sqrtf(dx*dx + dy*dy);
+  // midpoint relative to the image centre, rotated so that the bar is level
+  mx = (p->dot[0][0] + p->dot[1][0])/2 - IR_WIDTH/2;
+  my = (p->dot[0][1] + p->dot[1][1])/2 - IR_HEIGHT/2;
+  cs = cosf(phi);
+  sn = sinf(phi);
+  // the pointer moves opposite to the dots in the image
+  p->x = 0.5f - (cs*mx + sn*my)/IR_WIDTH;
+  p->y = 0.5f - (cs*my - sn*mx)/IR_HEIGHT;
+  if (sep > 0.0f)
+    p->dist = p->bar*IR_FOCAL/sep;
+  p->roll = -phi*RAD2DEG;
+  p->stamp = t;
+}
+
+// Synthetic key events. Some of the processing stages (such as the gesture
+// recognizer below) report their results as key events with codes beyond
+// the range of the real keys. These are queued per device and returned by
+// xwii_poll and xwii_poll_all along with the real key events, in the order
+// in which they occurred.
+
+#define SYNTHSIZE 64 // must be a power of 2
+
+// Synthetic key codes. The offset is added to the id of the gesture etc.
+#define CODE_GESTURE 256 // gesture recognized (state = score)
+#define CODE_TRIGGER 512 // trigger fired (state = value) or released (0)
+#define CODE_DRUM 768 // drum pad hit (state = velocity)
+
+typedef struct {
+  int code, state;
+  int64_t time;
+} synthevent;
+
+typedef struct {
+  unsigned head, tail;
+  synthevent buf[SYNTHSIZE];
+} synthq;
+
+static inline void synth_push(synthq *q, int code, int state, int64_t t)
+{
+  synthevent *ev;
+  if (q->tail - q->head >= SYNTHSIZE) q->head++; // full, drop the oldest
+  ev = &q->buf[q->tail++ & (SYNTHSIZE-1)];
+  ev->code = code;
+  ev->state = state;
+  ev->time = t;
+}
+
+static inline int synth_pop(synthq *q, synthevent *ev)
+{
+  if (q->head == q->tail) return 0;
+  *ev = q->buf[q->head++ & (SYNTHSIZE-1)];
+  return 1;
+}
+
+// Gesture recognition. Gestures are given as templates (sequences of x, y, z
+// samples of one of the motion sensors) which are matched against the
+// incoming data using subsequence dynamic time warping (DTW), so a gesture
+// may start at any point in the stream and may be performed faster or slower
+// than the template. For each template, we keep the last column of the DTW
+// matrix, which is updated with each new sample at a cost proportional to
+// the length of the template. The distance of the best match, normalized by
+// the magnitude of the template, is the score of the gesture. When the score
+// drops below the threshold, the template becomes a candidate, and the best
+// candidate is reported as soon as its score starts to rise again, i.e., at
+// the end of the gesture. All columns are then reset, so that each
+// performance of a gesture is only reported once.
+
+#define MAXGESTURES 64 // max number of templates
+#define MAXGESTURELEN 512 // max number of samples per template
+
+typedef struct {
+  int id;
+  int len;
+  float norm; // sum of the L1 magnitudes of the samples
+  float *x, *y, *z; // samples (structure of arrays)
+  float *D; // current DTW column (len+1 values)
+} gesture;
+
+typedef struct {
+  int enabled;
+  int source; // sensor (SENSOR_ACCEL etc.)
+  float threshold; // max score for a match
+  int n;
+  gesture g[MAXGESTURES];
+  // candidate match (-1 if none)
+  int cand;
+  float cand_score;
+  int64_t cand_time;
+  // template being recorded (-1 if none)
+  int rec_id, rec_len;
+  float *rec;
+  // scratch space for the DTW update
+  float cost[MAXGESTURELEN], tmp[MAXGESTURELEN];
+} gestures;
+
+static gestures *gestures_new(void)
+{
+  gestures *g = calloc(1, sizeof(gestures));
+  if (!g) return NULL;
+  g->source = SENSOR_ACCEL;
+  g->threshold = 0.2f;
+  g->cand = g->rec_id = -1;
+  return g;
+}
+
+static void gestures_free(gestures *g)
+{
+  int i;
+  if (!g) return;
+  for (i = 0; i < g->n; i++)
+    free(g->g[i].x);
+  free(g->rec);
+  free(g);
+}
+
+static void gesture_restart(gesture *g)
+{
+  int j;
+  g->D[0] = 0.0f; // a match may start anywhere
+  for (j = 1; j <= g->len; j++)
+    g->D[j] = INFINITY;
+}
+
+// Install a template with the given id, replacing any existing template with
+// the same id. The samples are given as a flat array of x, y, z triples,
+// separated by the given stride. Returns 0 on success, -1 if we're out of
+// memory or there are too many templates.
+static int gesture_add(gestures *gs, int id, const float *data, int len,
+		       int stride)
+{
+  gesture *g;
+  float *buf;
+  int i;
+  for (i = 0; i < gs->n && gs->g[i].id != id; i++) ;
+  if (i == MAXGESTURES) return -1;
+  if (!(buf = malloc((4*len+1)*sizeof(float)))) return -1;
+  g = &gs->g[i];
+  if (i < gs->n)
+    free(g->x);
+  else
+    gs->n++;
+  g->id = id;
+  g->len = len;
+  g->x = buf;
+  g->y = buf + len;
+  g->z = buf + 2*len;
+  g->D = buf + 3*len;
+  g->norm = 0.0f;
+  for (i = 0; i < len; i++, data += stride) {
+    g->x[i] = data[0];
+    g->y[i] = data[1];
+    g->z[i] = data[2];
+    g->norm += fabsf(data[0]) + fabsf(data[1]) + fabsf(data[2]);
+  }
+  if (g->norm <= 0.0f) g->norm = 1.0f;
+  gesture_restart(g);
+  gs->cand = -1;
+  return 0;
+}
+
+static void gesture_remove(gestures *gs, int id)
+{
+  int i;
+  for (i = 0; i < gs->n && gs->g[i].id != id; i++) ;
+  if (i == gs->n) return;
+  free(gs->g[i].x);
+  gs->g[i] = gs->g[--gs->n];
+  gs->cand = -1;
+}
+
+// Update the DTW column of a template with a new sample and return the
+// distance of the best match ending at this sample. The first two loops
+// have no dependencies between iterations and are vectorized by the
+// compiler; only the last one, which accounts for horizontal steps in the
+// warping path, needs to run sequentially.
+static float dtw_step(gesture *g, float x, float y, float z,
+		      float *restrict cost, float *restrict tmp)
+{
+  const float *restrict tx = g->x, *restrict ty = g->y, *restrict tz = g->z;
+  float *restrict D = g->D;
+  float prev = 0.0f;
+  int j, m = g->len;
+  for (j = 0; j < m; j++)
+    cost[j] = fabsf(x - tx[j]) + fabsf(y - ty[j]) + fabsf(z - tz[j]);
+  for (j = 0; j < m; j++)
+    tmp[j] = cost[j] + (D[j] < D[j+1] ? D[j] : D[j+1]);
+  for (j = 0; j < m; j++) {
+    float v = cost[j] + prev;
+    prev = tmp[j] < v ? tmp[j] : v;
+    D[j+1] = prev;
+  }
+  return prev;
+}
+
+// Feed a sample into the recognizer (or the template being recorded).
+static void gesture_feed(gestures *gs, const struct xwii_event_abs *a,
+			 int64_t t, synthq *q)
+{
+  float x = a->x, y = a->y, z = a->z, best_score = INFINITY;
+  int i, best = -1;
+  if (gs->rec_id >= 0) {
+    if (gs->rec_len < MAXGESTURELEN) {
+      float *r = gs->rec + 3*gs->rec_len++;
+      r[0] = x; r[1] = y; r[2] = z;
+    }
+    return;
+  }
+  for (i = 0; i < gs->n; i++) {
+    gesture *g = &gs->g[i];
+    float score = dtw_step(g, x, y, z, gs->cost, gs->tmp)/g->norm;
+    if (score < best_score) {
+      best_score = score;
+      best = i;
+    }
+  }
+  if (gs->cand >= 0 && best_score >= gs->cand_score) {
+    // the match is getting worse again, so the gesture is complete
+    synth_push(q, CODE_GESTURE + gs->g[gs->cand].id,
+	       lrintf(1000.0f*gs->cand_score), gs->cand_time);
+    gs->cand = -1;
+    for (i = 0; i < gs->n; i++)
+      gesture_restart(&gs->g[i]);
+  } else if (best >= 0 && best_score < gs->threshold) {
+    gs->cand = best;
+    gs->cand_score = best_score;
+    gs->cand_time = t;
+  }
+}
+
+// Triggers. These watch the data of a motion sensor for certain conditions
+// and report them as synthetic key events stamped with the time of the
+// sample which fired the trigger, so that short peaks aren't missed even if
+// the data is only queried now and then. Each trigger watches a single
+// sensor and may be of the following types:
+//
+// - magnitude: fires when the magnitude of the x, y, z vector exceeds the
+//   threshold, and is released when it drops below the release level
+// - zerocross: fires when the given axis changes its sign, i.e., it goes
+//   from below -threshold to above threshold (state 1) or vice versa
+//   (state -1); no release event
+// - jerk: like magnitude, but for the rate of change of the vector
+//   (units/sec), which detects strikes independent of the orientation
+// - deadzone: like magnitude, but only considers x and y; meant for the
+//   sticks, where the threshold is the size of the dead zone
+//
+// The fire event has the value which crossed the threshold as its state,
+// the release event has state 0.
+
+#define MAXTRIGGERS 32
+
+enum { TRIG_MAGNITUDE, TRIG_ZEROCROSS, TRIG_JERK, TRIG_DEADZONE };
+
+static const char *const trigger_names[] = {
+  "magnitude", "zerocross", "jerk", "deadzone", NULL
+};
+
+typedef struct {
+  int id, type, sensor;
+  int axis; // zerocross: the axis to watch (0-2)
+  float threshold, release;
+  int active; // trigger has fired (zerocross: the current sign)
+  int have_prev;
+  float prev[3];
+  int64_t prev_t;
+} trigger;
+
+typedef struct {
+  int n;
+  trigger t[MAXTRIGGERS];
+} triggers;
+
+// Evaluate a trigger on a new sample of its sensor.
+static void trigger_eval(trigger *tr, const struct xwii_event_abs *a,
+			 int64_t t, synthq *q)
+{
+  float v[3] = { a->x, a->y, a->z }, m;
+  int code = CODE_TRIGGER + tr->id;
+  switch (tr->type) {
+  case TRIG_ZEROCROSS:
+    m = v[tr->axis];
+    if (m > tr->threshold && tr->active <= 0) {
+      if (tr->active) synth_push(q, code, 1, t);
+      tr->active = 1;
+    } else if (m < -tr->threshold && tr->active >= 0) {
+      if (tr->active) synth_push(q, code, -1, t);
+      tr->active = -1;
+    }
+    return;
+  case TRIG_JERK:
+    {
+      float dt = tr->have_prev && t > tr->prev_t ? (t - tr->prev_t)*1e-6f :
+	1.0f/NOMINAL_RATE;
+      float dx = v[0] - tr->prev[0], dy = v[1] - tr->prev[1],
+	dz = v[2] - tr->prev[2];
+      int first = !tr->have_prev;
+      memcpy(tr->prev, v, sizeof(v));
+      tr->prev_t = t;
+      tr->have_prev = 1;
+      if (first) return;
+      m = sqrtf(dx*dx + dy*dy + dz*dz)/dt;
+      break;
+    }
+  case TRIG_DEADZONE:
+    m = sqrtf(v[0]*v[0] + v[1]*v[1]);
+    break;
+  default:
+    m = sqrtf(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+    break;
+  }
+  if (!tr->active && m > tr->threshold) {
+    tr->active = 1;
+    synth_push(q, code, lrintf(m), t);
+  } else if (tr->active && m < tr->release) {
+    tr->active = 0;
+    synth_push(q, code, 0, t);
+  }
+}
+
+// Resampling. The Wiimote reports its data at irregular intervals (and the
+// kernel drops reports which don't change anything), but many applications
+// need a uniform stream of data. The resampler turns the samples of a motion
+// sensor into frames at a fixed rate, using linear or cubic (Hermite)
+// interpolation between the timestamps of the samples. Cubic interpolation
+// needs to look one sample ahead, so it adds the latency of one sample. The
+// frames are kept in a ring buffer until they are fetched in a batch. If the
+// sensor doesn't report anything for a while, its value hasn't changed, so
+// we keep producing frames with the last value, but only up to HOLD_DELAY
+// usecs before the current time, as newer samples may still be on their way.
+
+#define RSFRAMES 1024 // frame buffer size, must be a power of 2
+#define HOLD_DELAY 20000 // usecs
+
+typedef struct {
+  double rate; // frame rate (Hz)
+  int cubic; // cubic interpolation
+  int n; // number of samples below (up to 4)
+  int64_t st[4]; // the last few samples, oldest first
+  float sv[4][3];
+  int64_t t0; // time of the first frame
+  uint64_t k; // number of the next frame
+  uint64_t head, tail, lost; // frame buffer
+  int64_t ft[RSFRAMES];
+  float fv[RSFRAMES][3];
+} resampler;
+
+static inline int64_t frame_time(const resampler *rs, uint64_t k)
+{
+  return rs->t0 + llround(k*1e6/rs->rate);
+}
+
+static inline void frame_add(resampler *rs, int64_t t, const float v[3])
+{
+  unsigned i = rs->tail++ & (RSFRAMES-1);
+  if (rs->tail - rs->head > RSFRAMES) {
+    rs->head++;
+    rs->lost++;
+  }
+  rs->ft[i] = t;
+  memcpy(rs->fv[i], v, sizeof(rs->fv[i]));
+}
+
+// Add a sample and produce all frames up to the point where the
+// interpolation is complete.
+static void resample_feed(resampler *rs, int64_t t, const float v[3])
+{
+  int i0, i1, i2, i3;
+  int64_t ft;
+  if (rs->n && t <= rs->st[rs->n-1]) t = rs->st[rs->n-1] + 1;
+  if (rs->n == 4) {
+    memmove(rs->st, rs->st+1, 3*sizeof(rs->st[0]));
+    memmove(rs->sv, rs->sv+1, 3*sizeof(rs->sv[0]));
+    rs->n--;
+  }
+  rs->st[rs->n] = t;
+  memcpy(rs->sv[rs->n], v, sizeof(rs->sv[0]));
+  rs->n++;
+  if (rs->n == 1) {
+    // first sample, start the frames here
+    rs->t0 = t;
+    rs->k = 0;
+    return;
+  }
+  // the segment to be interpolated is i1..i2, with the neighbours i0 and i3
+  // for cubic interpolation
+  if (rs->cubic) {
+    if (rs->n < 3) return;
+    i3 = rs->n-1; i2 = i3-1; i1 = i2-1; i0 = i1 > 0 ? i1-1 : i1;
+  } else {
+    i2 = rs->n-1; i1 = i2-1; i0 = i1; i3 = i2;
+  }
+  while ((ft = frame_time(rs, rs->k)) <= rs->st[i2]) {
+    float h = rs->st[i2] - rs->st[i1], u = (ft - rs->st[i1])/h, f[3];
+    int j;
+    if (u < 0.0f) u = 0.0f;
+    if (!rs->cubic) {
+      for (j = 0; j < 3; j++)
+	f[j] = rs->sv[i1][j] + u*(rs->sv[i2][j] - rs->sv[i1][j]);
+    } else {
+      float u2 = u*u, u3 = u2*u;
+      float h00 = 2*u3 - 3*u2 + 1, h10 = u3 - 2*u2 + u;
+      float h01 = -2*u3 + 3*u2, h11 = u3 - u2;
+      float s1 = h/(rs->st[i2] - rs->st[i0]), s2 = h/(rs->st[i3] - rs->st[i1]);
+      for (j = 0; j < 3; j++) {
+	float m1 = (rs->sv[i2][j] - rs->sv[i0][j])*s1;
+	float m2 = (rs->sv[i3][j] - rs->sv[i1][j])*s2;
+	f[j] = h00*rs->sv[i1][j] + h10*m1 + h01*rs->sv[i2][j] + h11*m2;
+      }
+    }
+    frame_add(rs, ft, f);
+    rs->k++;
+  }
+}
+
+static inline void resample_abs(resampler *rs, const struct xwii_event_abs *a,
+				int64_t t)
+{
+  float v[3] = { a->x, a->y, a->z };
+  resample_feed(rs, t, v);
+}
+
+// Repeat the last sample up to HOLD_DELAY before the given time, if the
+// sensor hasn't reported anything in the meantime.
+static void resample_hold(resampler *rs, int64_t now)
+{
+  int64_t t = now - HOLD_DELAY;
+  if (rs->n > 0 && t > rs->st[rs->n-1] + llround(1e6/rs->rate)) {
+    float v[3];
+    memcpy(v, rs->sv[rs->n-1], sizeof(v));
+    resample_feed(rs, t, v);
+  }
+}
+
+// Balance Board. The raw data are the weights measured by the four sensors
+// in the corners of the board, in units of 10 g. From these we compute the
+// total weight (kg) and the centre of pressure (mm from the centre of the
+// board, x to the right, y to the front, i.e., towards the power button),
+// with the tare subtracted and some smoothing applied, at the full event
+// rate. Taring averages the sensor values over TARE_SAMPLES samples.
+
+#define BOARD_WIDTH 433.0f // distance between the sensors (mm)
+#define BOARD_LENGTH 238.0f
+#define BOARD_MIN_WEIGHT 1.0f // min. weight for the centre of pressure (kg)
+#define BOARD_SMOOTH 0.3f // default smoothing factor
+#define TARE_SAMPLES 50
+
+// The order of the sensors in the board events.
+enum { BOARD_TR, BOARD_BR, BOARD_TL, BOARD_BL };
+
+typedef struct {
+  float smooth; // smoothing factor (1 = none, 0 = default)
+  float zero[4]; // tare
+  int tare_n; // number of samples left to tare
+  float tare_sum[4];
+  int init; // have data
+  float w[4]; // corner weights (kg), tared and smoothed
+  float total, x, y; // total weight and centre of pressure
+} board;
+
+static void board_update(board *b, const struct xwii_event_abs abs[4])
+{
+  float a = b->smooth > 0.0f ? b->smooth : BOARD_SMOOTH;
+  int i;
+  if (b->tare_n > 0) {
+    for (i = 0; i < 4; i++)
+      b->tare_sum[i] += abs[i].x;
+    if (--b->tare_n == 0)
+      for (i = 0; i < 4; i++)
+	b->zero[i] = b->tare_sum[i]/TARE_SAMPLES;
+  }
+  b->total = 0.0f;
+  for (i = 0; i < 4; i++) {
+    float w = (abs[i].x - b->zero[i])/100.0f;
+    b->w[i] = b->init ? b->w[i] + a*(w - b->w[i]) : w;
+    b->total += b->w[i];
+  }
+  b->init = 1;
+  if (b->total >= BOARD_MIN_WEIGHT) {
+    b->x = ((b->w[BOARD_TR] + b->w[BOARD_BR]) -
+	    (b->w[BOARD_TL] + b->w[BOARD_BL]))/b->total*BOARD_WIDTH/2;
+    b->y = ((b->w[BOARD_TL] + b->w[BOARD_TR]) -
+	    (b->w[BOARD_BL] + b->w[BOARD_BR]))/b->total*BOARD_LENGTH/2;
+  } else {
+    b->x = b->y = 0.0f;
+  }
+}
+
+// Stick shaping for the Classic and Pro Controllers. The raw stick values
+// of these have very different ranges (the Classic Controller's left stick
+// has 6 bits of resolution, its right stick only 5, while the Pro
+// Controller has 12 bits), so if shaping is enabled, we scale the sticks to
+// a common range of -100..100 (0..100 for the analog triggers of the
+// Classic Controller), with a radial dead zone around the centre (or at the
+// bottom of the triggers). The raw ranges below are nominal values which
+// can be changed if a device doesn't reach the full output range.
+
+static const float classic_range[3] = { 32.0f, 16.0f, 31.0f };
+static const float pro_range[3] = { 1024.0f, 1024.0f, 0.0f };
+
+typedef struct {
+  int enabled;
+  float deadzone; // size of the dead zone (fraction of the range)
+  float range[3]; // raw ranges of the left and right stick and the triggers
+} stickshape;
+
+static void stick_shape(struct xwii_event_abs *a, float range, float dz)
+{
+  float x = a->x/range, y = a->y/range, r = sqrtf(x*x + y*y), k;
+  if (r <= dz) {
+    a->x = a->y = 0;
+    return;
+  }
+  k = ((r > 1.0f ? 1.0f : r) - dz)/(1.0f - dz)/r*STICK_RANGE;
+  a->x = lrintf(x*k);
+  a->y = lrintf(y*k);
+}
+
+static inline int32_t trigger_shape(int32_t v, float range, float dz)
+{
+  float x = v/range;
+  if (x <= dz) return 0;
+  if (x > 1.0f) x = 1.0f;
+  return lrintf((x - dz)/(1.0f - dz)*STICK_RANGE);
+}
+
+// Shape the sticks of a Classic Controller (with triggers) or Pro
+// Controller (without) event.
+static void shape_sticks(const stickshape *sh, struct xwii_event_abs *abs,
+			 int triggers)
+{
+  stick_shape(&abs[0], sh->range[0], sh->deadzone);
+  stick_shape(&abs[1], sh->range[1], sh->deadzone);
+  if (triggers) {
+    abs[2].x = trigger_shape(abs[2].x, sh->range[2], sh->deadzone);
+    abs[2].y = trigger_shape(abs[2].y, sh->range[2], sh->deadzone);
+  }
+}
+
+// Timestamps. The kernel stamps input events using the wall clock, which may
+// jump when the system time is adjusted. We convert these to the monotonic
+// clock, using the offset between the two clocks at the time the events are
+// read, so that all timestamps reported by this module are monotonic
+// microseconds which can be compared with the current time from xwii_time.
+
+static int64_t clock_offs; // wall clock - monotonic clock, in usecs
+
+static inline int64_t timespec_usecs(const struct timespec *ts)
+{
+  return (int64_t)ts->tv_sec*1000000 + ts->tv_nsec/1000;
+}
+
+static inline int64_t monotonic_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return timespec_usecs(&ts);
+}
+
+static void update_clock_offs(void)
+{
+  struct timespec rt, mt;
+  clock_gettime(CLOCK_REALTIME, &rt);
+  clock_gettime(CLOCK_MONOTONIC, &mt);
+  clock_offs = timespec_usecs(&rt) - timespec_usecs(&mt);
+}
+
+// Timestamp of an event in monotonic usecs.
+static inline int64_t event_time(const struct xwii_event *event)
+{
+  return (int64_t)event->time.tv_sec*1000000 + event->time.tv_usec -
+    clock_offs;
+}
+
+// Set the timestamp of an event from monotonic usecs.
+static inline void set_event_time(struct xwii_event *event, int64_t t)
+{
+  t += clock_offs;
+  event->time.tv_sec = t / 1000000;
+  event->time.tv_usec = t % 1000000;
+}
+
+// Arm a timerfd so that it expires at the given time (monotonic usecs). Any
+// expiration which hasn't been consumed yet is cleared first. This is used
+// to signal input on replayed and mock devices.
+static void timer_arm(int fd, int64_t t)
+{
+  struct itimerspec its;
+  uint64_t val;
+  if (read(fd, &val, sizeof(val)) < 0) {
+    // EAGAIN, timer hasn't expired yet
+  }
+  memset(&its, 0, sizeof(its));
+  if (t <= 0) t = 1; // a zero value would disarm the timer
+  its.it_value.tv_sec = t / 1000000;
+  its.it_value.tv_nsec = t % 1000000 * 1000;
+  timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+// Session recorder. If enabled, every event dispatched on a device is
+// written to a binary log file, so that a session can be analyzed (or
+// replayed) later. The events are recorded as they come from the device,
+// before any processing. To keep the cost on the dispatch path negligible,
+// the events are just copied into a queue, which is emptied by a writer
+// thread in regular intervals. If the queue overflows (which shouldn't
+// happen unless the disk is very slow), events are dropped and counted.
+//
+// The log starts with the magic "XWIIREC1", followed by a 16 bit length and
+// the device's serial number (or its path if the serial isn't known). Each
+// event is stored as a 16 bit length (the number of bytes following), the 16
+// bit event type, the 64 bit timestamp (monotonic usecs), and the payload:
+// the key code and state for key events, the x, y, z triples of the abs
+// values used by the event type for motion events (see event_nabs below),
+// and nothing for other events. All values are 32 bit integers unless noted
+// otherwise, in host byte order.
+
+#define RECSIZE 4096 // size of the recorder queue, must be a power of 2
+#define REC_INTERVAL 10 // writer thread interval (msecs)
+#define REC_MAGIC "XWIIREC1"
+
+typedef struct {
+  int64_t time;
+  struct xwii_event ev;
+} recentry;
+
+typedef struct {
+  atomic_uint head; char pad1[64];
+  atomic_uint tail; char pad2[64];
+  atomic_int running; // cleared to stop the writer thread
+  atomic_int error; // errno of the first write error
+  unsigned dropped; // number of events dropped (only written by producer)
+  uint64_t written; // number of events written (only written by writer)
+  FILE *fp;
+  pthread_t thread;
+  recentry buf[RECSIZE];
+} recorder;
+
+// The number of abs values used by each type of event, -1 for key events.
+static int event_nabs(unsigned type)
+{
+  switch (type) {
+  case XWII_EVENT_KEY:
+  case XWII_EVENT_CLASSIC_CONTROLLER_KEY:
+  case XWII_EVENT_PRO_CONTROLLER_KEY:
+  case XWII_EVENT_NUNCHUK_KEY:
+  case XWII_EVENT_DRUMS_KEY:
+  case XWII_EVENT_GUITAR_KEY:
+    return -1;
+  case XWII_EVENT_ACCEL:
+  case XWII_EVENT_MOTION_PLUS:
+    return 1;
+  case XWII_EVENT_NUNCHUK_MOVE:
+  case XWII_EVENT_PRO_CONTROLLER_MOVE:
+    return 2;
+  case XWII_EVENT_CLASSIC_CONTROLLER_MOVE:
+  case XWII_EVENT_GUITAR_MOVE:
+    return 3;
+  case XWII_EVENT_IR:
+  case XWII_EVENT_BALANCE_BOARD:
+    return 4;
+  case XWII_EVENT_DRUMS_MOVE:
+    return XWII_DRUMS_ABS_NUM;
+  default:
+    return 0;
+  }
+}
+
+// Payload size of an event type in the log format.
+static inline size_t event_payload(unsigned type)
+{
+  int n = event_nabs(type);
+  return n < 0 ? 8 : 12*n;
+}
+
+// Encode an event in the log format. Returns the size of the record. The
+// buffer needn't be aligned, so the fields are copied in with memcpy (as in
+// event_decode below).
+static size_t event_encode(const struct xwii_event *ev, int64_t t,
+			   unsigned char *buf)
+{
+  int n = event_nabs(ev->type), i;
+  uint16_t len, type = ev->type;
+  int32_t v[3*XWII_DRUMS_ABS_NUM];
+  size_t size = event_payload(type);
+  if (n < 0) {
+    v[0] = ev->v.key.code;
+    v[1] = ev->v.key.state;
+  } else {
+    for (i = 0; i < n; i++) {
+      v[3*i] = ev->v.abs[i].x;
+      v[3*i+1] = ev->v.abs[i].y;
+      v[3*i+2] = ev->v.abs[i].z;
+    }
+  }
+  len = 10 + size;
+  memcpy(buf, &len, 2);
+  memcpy(buf+2, &type, 2);
+  memcpy(buf+4, &t, 8);
+  memcpy(buf+12, v, size);
+  return len + 2;
+}
+
+static void *recorder_main(void *data)
+{
+  recorder *rc = data;
+  struct timespec ts = { 0, REC_INTERVAL*1000000L };
+  unsigned char rec[12 + 12*XWII_DRUMS_ABS_NUM];
+  while (1) {
+    int running = atomic_load(&rc->running);
+    unsigned tail = atomic_load_explicit(&rc->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&rc->head, memory_order_acquire);
+    for (; tail != head; tail++) {
+      recentry *e = &rc->buf[tail & (RECSIZE-1)];
+      size_t len = event_encode(&e->ev, e->time, rec);
+      if (fwrite(rec, 1, len, rc->fp) != len) {
+	int zero = 0;
+	atomic_compare_exchange_strong(&rc->error, &zero, errno ? errno : EIO);
+      } else {
+	rc->written++;
+      }
+    }
+    atomic_store_explicit(&rc->tail, tail, memory_order_release);
+    // stop once the queue has been emptied
+    if (!running) break;
+    nanosleep(&ts, NULL);
+  }
+  return NULL;
+}
+
+// Producer side: queue an event for writing.
+static inline void recorder_push(recorder *rc, const struct xwii_event *ev,
+				 int64_t t)
+{
+  unsigned head = atomic_load_explicit(&rc->head, memory_order_relaxed);
+  recentry *e;
+  if (head - atomic_load_explicit(&rc->tail, memory_order_acquire) >=
+      RECSIZE) {
+    rc->dropped++;
+    return;
+  }
+  e = &rc->buf[head & (RECSIZE-1)];
+  e->time = t;
+  e->ev = *ev;
+  atomic_store_explicit(&rc->head, head+1, memory_order_release);
+}
+
+// Start recording to the given file. Returns NULL (and sets errno) in case
+// of error.
+static recorder *recorder_start(const char *fname, const char *key)
+{
+  recorder *rc = calloc(1, sizeof(recorder));
+  uint16_t n = strlen(key);
+  int ret;
+  if (!rc) return NULL;
+  if (!(rc->fp = fopen(fname, "wb"))) goto err;
+  setvbuf(rc->fp, NULL, _IOFBF, 1<<16);
+  if (fwrite(REC_MAGIC, 1, 8, rc->fp) != 8 ||
+      fwrite(&n, 2, 1, rc->fp) != 1 || fwrite(key, 1, n, rc->fp) != n)
+    goto err;
+  atomic_store(&rc->running, 1);
+  if ((ret = pthread_create(&rc->thread, NULL, recorder_main, rc))) {
+    errno = ret;
+    goto err;
+  }
+  return rc;
+ err:
+  ret = errno;
+  if (rc->fp) fclose(rc->fp);
+  free(rc);
+  errno = ret;
+  return NULL;
+}
+
+// Stop recording: write out the remaining events and close the file.
+// Returns 0 if all went well, an errno value otherwise.
+static int recorder_stop(recorder *rc)
+{
+  int err;
+  atomic_store(&rc->running, 0);
+  pthread_join(rc->thread, NULL);
+  err = atomic_load(&rc->error);
+  if (fclose(rc->fp) && !err) err = errno;
+  return err;
+}
+
+// Replay. A log written by the session recorder can be opened in place of
+// a live device, which is useful for testing and benchmarking without a
+// Wiimote. The log is mapped into memory and the events are decoded from the
+// mapping as they are consumed. Replay either proceeds in real time, i.e.,
+// each event becomes available when it is due according to its recorded
+// timestamp, or as fast as possible. In both cases the events are stamped
+// with the time at which they would have been due, so that the processing
+// stages see the same intervals between events as in the recorded session.
+// Readiness is signaled through a timerfd, which stands in for the device's
+// file descriptor, so a replayed device can be polled like any other. When
+// replaying as fast as possible, the replay pauses after each batch of
+// events (i.e., the next read reports that there are no more events, while
+// the timerfd stays readable), so that xwii_poll_all returns the events in
+// chunks rather than all of them in a single call.
+
+#define FAST_BATCH 64 // batch size when replaying as fast as possible
+
+typedef struct {
+  unsigned char *base; // mapped log
+  size_t len; // length of the mapping
+  size_t size; // end of the last complete record
+  size_t first, pos; // offset of the first and the next event
+  uint64_t nevents; // number of events in the log
+  int64_t t0, duration; // time of the first event, length of the session
+  int64_t start; // time at which the replay started (monotonic usecs)
+  unsigned ifaces; // interfaces used by the events in the log
+  int realtime; // replay in real time (else as fast as possible)
+  unsigned batch; // events delivered since the last pause (fast mode)
+  int fd; // timerfd signaling that the next event is due
+  char *key; // device key stored in the log
+} replay;
+
+typedef struct {
+  const char *fname; // name of the log file
+  int realtime; // replay in real time (else as fast as possible)
+} replayopts;
+
+// The interface an event type belongs to.
+static unsigned event_iface(unsigned type)
+{
+  switch (type) {
+  case XWII_EVENT_KEY:
+    return XWII_IFACE_CORE;
+  // the motion queries only check for the core interface, so we report it
+  // along with the accelerometer and IR interfaces
+  case XWII_EVENT_ACCEL:
+    return XWII_IFACE_CORE | XWII_IFACE_ACCEL;
+  case XWII_EVENT_IR:
+    return XWII_IFACE_CORE | XWII_IFACE_IR;
+  case XWII_EVENT_MOTION_PLUS:
+    return XWII_IFACE_MOTION_PLUS;
+  case XWII_EVENT_NUNCHUK_KEY:
+  case XWII_EVENT_NUNCHUK_MOVE:
+    return XWII_IFACE_NUNCHUK;
+  case XWII_EVENT_CLASSIC_CONTROLLER_KEY:
+  case XWII_EVENT_CLASSIC_CONTROLLER_MOVE:
+    return XWII_IFACE_CLASSIC_CONTROLLER;
+  case XWII_EVENT_PRO_CONTROLLER_KEY:
+  case XWII_EVENT_PRO_CONTROLLER_MOVE:
+    return XWII_IFACE_PRO_CONTROLLER;
+  case XWII_EVENT_BALANCE_BOARD:
+    return XWII_IFACE_BALANCE_BOARD;
+  case XWII_EVENT_GUITAR_KEY:
+  case XWII_EVENT_GUITAR_MOVE:
+    return XWII_IFACE_GUITAR;
+  case XWII_EVENT_DRUMS_KEY:
+  case XWII_EVENT_DRUMS_MOVE:
+    return XWII_IFACE_DRUMS;
+  default:
+    return 0;
+  }
+}
+
+// Decode the event at the given offset of the log, returning its timestamp.
+// The record has already been validated by replay_open.
+static int64_t event_decode(const unsigned char *rec, struct xwii_event *ev)
+{
+  uint16_t type;
+  int64_t t;
+  int32_t v[3*XWII_DRUMS_ABS_NUM];
+  int n, i;
+  memcpy(&type, rec+2, 2);
+  memcpy(&t, rec+4, 8);
+  n = event_nabs(type);
+  memset(ev, 0, sizeof(*ev));
+  ev->type = type;
+  memcpy(v, rec+12, event_payload(type));
+  if (n < 0) {
+    ev->v.key.code = v[0];
+    ev->v.key.state = v[1];
+  } else {
+    for (i = 0; i < n; i++) {
+      ev->v.abs[i].x = v[3*i];
+      ev->v.abs[i].y = v[3*i+1];
+      ev->v.abs[i].z = v[3*i+2];
+    }
+  }
+  return t;
+}
+
+// Map a log and check its contents, and start replaying it. Returns NULL
+// (and sets errno) in case of error; EINVAL means that the file isn't a
+// valid log. A log whose last record was cut short (e.g., because the
+// recording process was killed) is replayed up to the last complete record.
+static replay *replay_open(const replayopts *o)
+{
+  const char *fname = o->fname;
+  replay *rp = calloc(1, sizeof(replay));
+  struct stat st;
+  uint16_t n;
+  size_t pos;
+  int fd = -1, ret;
+  if (!rp) return NULL;
+  rp->fd = -1;
+  if ((fd = open(fname, O_RDONLY|O_CLOEXEC)) < 0 || fstat(fd, &st) < 0)
+    goto err;
+  rp->len = rp->size = st.st_size;
+  if (rp->size < 10) {
+    errno = EINVAL;
+    goto err;
+  }
+  rp->base = mmap(NULL, rp->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (rp->base == MAP_FAILED) {
+    rp->base = NULL;
+    goto err;
+  }
+  close(fd);
+  fd = -1;
+  // the log is read sequentially, once
+  madvise(rp->base, rp->size, MADV_SEQUENTIAL);
+  memcpy(&n, rp->base+8, 2);
+  if (memcmp(rp->base, REC_MAGIC, 8) || 10 + (size_t)n > rp->size) {
+    errno = EINVAL;
+    goto err;
+  }
+  if (!(rp->key = strndup((char*)rp->base+10, n))) goto err;
+  // check the records, and collect the interfaces and the time range
+  rp->first = pos = 10 + n;
+  while (pos < rp->size) {
+    uint16_t len, type;
+    int64_t t;
+    if (rp->size - pos < 12) break;
+    memcpy(&len, rp->base+pos, 2);
+    memcpy(&type, rp->base+pos+2, 2);
+    memcpy(&t, rp->base+pos+4, 8);
+    if (len != 10 + event_payload(type) || rp->size - pos < 2 + (size_t)len)
+      break;
+    if (!rp->nevents) rp->t0 = t;
+    rp->duration = t - rp->t0;
+    rp->ifaces |= event_iface(type);
+    rp->nevents++;
+    pos += 2 + len;
+  }
+  if (pos < rp->size) {
+    fprintf(stderr, "xwii_replay: %s: ignoring %zu bytes of truncated data "
+	    "at end of log\n", fname, rp->size - pos);
+    rp->size = pos;
+  }
+  rp->pos = rp->first;
+  rp->realtime = o->realtime;
+  rp->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+  if (rp->fd < 0) {
+    free(rp->key);
+    goto err;
+  }
+  rp->start = monotonic_time();
+  timer_arm(rp->fd, rp->start);
+  return rp;
+ err:
+  ret = errno;
+  if (fd >= 0) close(fd);
+  if (rp->base) munmap(rp->base, rp->len);
+  free(rp);
+  errno = ret;
+  return NULL;
+}
+
+static void replay_close(replay *rp)
+{
+  free(rp->key);
+  close(rp->fd);
+  munmap(rp->base, rp->len);
+  free(rp);
+}
+
+// Fetch the next event of a replayed log. Returns 0 if an event was read,
+// and -EAGAIN if the next event isn't due yet, in which case the timer is
+// armed to signal when it is. At the end of the log, a GONE event is
+// reported, as if the device had been removed.
+static int replay_next(replay *rp, struct xwii_event *event)
+{
+  int64_t due;
+  if (rp->pos >= rp->size) {
+    memset(event, 0, sizeof(*event));
+    event->type = XWII_EVENT_GONE;
+    due = monotonic_time();
+  } else {
+    if (!rp->realtime && ++rp->batch > FAST_BATCH) {
+      rp->batch = 0;
+      return -EAGAIN;
+    }
+    due = rp->start + event_decode(rp->base+rp->pos, event) - rp->t0;
+    if (rp->realtime && due > monotonic_time()) {
+      timer_arm(rp->fd, due);
+      return -EAGAIN;
+    }
+    rp->pos += 12 + event_payload(event->type);
+  }
+  set_event_time(event, due);
+  return 0;
+}
+
+// Mock devices. For testing without a Wiimote, a synthetic device can be
+// created which generates a configurable mix of events: accelerometer,
+// Motion-Plus, IR, Nunchuk and Balance Board data, each at its own rate,
+// following sine waves or random noise, along with a steady stream of key
+// presses and releases (a "key storm"). The rates can be set well beyond
+// those of a real device for stress testing. As with replays, the events
+// are either generated in real time or as fast as they are consumed (in
+// batches, see FAST_BATCH above), and a timerfd signals when the next event
+// is due. At least one kind of event must be enabled. The random generator
+// is seeded explicitly, so that the generated events are reproducible.
+
+enum { MOCK_KEYS, MOCK_ACCEL, MOCK_MOTION, MOCK_IR, MOCK_NUNCHUK,
+       MOCK_BOARD, NMOCK };
+
+static const char *mock_names[NMOCK] = {
+  "keys", "accel", "motionplus", "ir", "nunchuk", "board"
+};
+
+static const unsigned mock_type[NMOCK] = {
+  XWII_EVENT_KEY, XWII_EVENT_ACCEL, XWII_EVENT_MOTION_PLUS, XWII_EVENT_IR,
+  XWII_EVENT_NUNCHUK_MOVE, XWII_EVENT_BALANCE_BOARD
+};
+
+#define MOCK_WEIGHT 1750 // board sensor value of a 70 kg person (10 g units)
+
+typedef struct {
+  double rate[NMOCK]; // event rates (Hz, 0 if disabled)
+  int noise; // random noise instead of sine waves
+  double amp, freq; // amplitude and frequency of the motion
+  uint32_t seed; // random seed
+  uint64_t count; // number of events to generate (0 = unlimited)
+  int realtime; // generate events in real time (else as fast as possible)
+} mockopts;
+
+typedef struct {
+  mockopts o;
+  int64_t start; // time at which the device was opened (monotonic usecs)
+  int64_t due[NMOCK]; // time at which the next event of each kind is due
+  uint64_t k[NMOCK]; // number of events of each kind generated so far
+  uint64_t n; // total number of events generated so far
+  uint32_t rnd; // state of the random generator
+  unsigned ifaces; // interfaces of the enabled event kinds
+  uint8_t leds; // LED state, as set by the application
+  unsigned batch; // events generated since the last pause (fast mode)
+  int fd; // timerfd signaling that the next event is due
+} mock;
+
+// xorshift32, good enough for noise
+static inline uint32_t mock_rand(mock *m)
+{
+  uint32_t x = m->rnd;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return m->rnd = x;
+}
+
+// Motion value of the given axis at the given time.
+static inline int32_t mock_value(mock *m, int axis, int64_t t)
+{
+  if (m->o.noise)
+    return lround(m->o.amp * (mock_rand(m) / 2147483647.5 - 1.0));
+  else
+    return lround(m->o.amp * sin(2.0*M_PI * (m->o.freq * (t - m->start)/1e6
+					   + axis/3.0)));
+}
+
+static inline int32_t clamp(int32_t x, int32_t lo, int32_t hi)
+{
+  return x < lo ? lo : x > hi ? hi : x;
+}
+
+// Fill in the payload of an event of the given kind.
+static void mock_fill(mock *m, int kind, struct xwii_event *event, int64_t t)
+{
+  struct xwii_event_abs *a = event->v.abs;
+  int i, w = IR_WIDTH, h = IR_HEIGHT;
+  switch (kind) {
+  case MOCK_KEYS:
+    // press and release the core buttons in turn
+    event->v.key.code = m->k[kind]/2 % (XWII_KEY_TWO+1);
+    event->v.key.state = !(m->k[kind] & 1);
+    break;
+  case MOCK_ACCEL:
+  case MOCK_MOTION:
+    a[0].x = mock_value(m, 0, t);
+    a[0].y = mock_value(m, 1, t);
+    a[0].z = mock_value(m, 2, t);
+    break;
+  case MOCK_IR:
+    // two dots (the sensor bar), the others invisible
+    for (i = 0; i < 2; i++) {
+      a[i].x = clamp(w/2 + (2*i-1)*w/8 + mock_value(m, 0, t), 0, w-1);
+      a[i].y = clamp(h/2 + mock_value(m, 1, t), 0, h-1);
+    }
+    for (; i < 4; i++)
+      a[i].x = a[i].y = 1023;
+    break;
+  case MOCK_NUNCHUK:
+    a[0].x = clamp(mock_value(m, 0, t), -STICK_RANGE, STICK_RANGE);
+    a[0].y = clamp(mock_value(m, 1, t), -STICK_RANGE, STICK_RANGE);
+    a[1].x = mock_value(m, 0, t);
+    a[1].y = mock_value(m, 1, t);
+    a[1].z = mock_value(m, 2, t);
+    break;
+  case MOCK_BOARD:
+    // someone swaying on the board
+    a[BOARD_TR].x = MOCK_WEIGHT + mock_value(m, 0, t);
+    a[BOARD_BR].x = MOCK_WEIGHT + mock_value(m, 1, t);
+    a[BOARD_TL].x = MOCK_WEIGHT - mock_value(m, 1, t);
+    a[BOARD_BL].x = MOCK_WEIGHT - mock_value(m, 0, t);
+    break;
+  }
+}
+
+static mock *mock_open(const mockopts *o)
+{
+  mock *m = calloc(1, sizeof(mock));
+  int i;
+  if (!m) return NULL;
+  m->o = *o;
+  m->rnd = o->seed ? o->seed : 1;
+  m->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+  if (m->fd < 0) {
+    free(m);
+    return NULL;
+  }
+  m->start = monotonic_time();
+  for (i = 0; i < NMOCK; i++)
+    if (o->rate[i] > 0) {
+      m->due[i] = m->start;
+      m->ifaces |= event_iface(mock_type[i]);
+    }
+  timer_arm(m->fd, m->start);
+  return m;
+}
+
+static void mock_close(mock *m)
+{
+  close(m->fd);
+  free(m);
+}
+
+// Generate the next event. Returns 0 if an event was generated, and -EAGAIN
+// if the next event isn't due yet, in which case the timer is armed to
+// signal when it is. Once the given number of events has been generated, a
+// GONE event is reported.
+static int mock_next(mock *m, struct xwii_event *event)
+{
+  int i, kind = -1;
+  int64_t t;
+  memset(event, 0, sizeof(*event));
+  if (m->o.count && m->n >= m->o.count) {
+    event->type = XWII_EVENT_GONE;
+    set_event_time(event, monotonic_time());
+    return 0;
+  }
+  for (i = 0; i < NMOCK; i++)
+    if (m->o.rate[i] > 0 && (kind < 0 || m->due[i] < m->due[kind]))
+      kind = i;
+  if (kind < 0) return -EAGAIN;
+  if (!m->o.realtime && ++m->batch > FAST_BATCH) {
+    m->batch = 0;
+    return -EAGAIN;
+  }
+  t = m->due[kind];
+  if (m->o.realtime && t > monotonic_time()) {
+    timer_arm(m->fd, t);
+    return -EAGAIN;
+  }
+  event->type = mock_type[kind];
+  mock_fill(m, kind, event, t);
+  set_event_time(event, t);
+  m->k[kind]++;
+  m->due[kind] = m->start + (int64_t)(m->k[kind] * 1e6 / m->o.rate[kind]);
+  m->n++;
+  return 0;
+}
+
+// Device backends. All access to a device goes through the following table
+// of operations, so that other event sources can stand in for libxwiimote.
+// There are three backends: live devices (libxwiimote), replayed logs and
+// mock devices. The operations take the backend's own device handle. Only
+// live devices are tracked in the device registry and serviced by the
+// reader thread; the others are always read directly.
+
+typedef struct {
+  const char *name; // backend name (used in diagnostics)
+  int live; // live device (in the registry, may be read by the reader)
+  // open a device, returns the backend handle, NULL (and errno) on error;
+  // the argument is a device path, or a pointer to replayopts or mockopts;
+  // the flags are additional interfaces to open (live devices only)
+  void *(*open)(const void *arg, int flags);
+  void (*close)(void *h);
+  int (*get_fd)(void *h); // descriptor to poll for input
+  int (*dispatch)(void *h, struct xwii_event *event); // read the next event
+  unsigned (*available)(void *h); // available interfaces
+  unsigned (*opened)(void *h); // opened interfaces
+  int (*reopen)(void *h); // reopen the available interfaces after hotplug
+  int (*get_battery)(void *h, uint8_t *capacity);
+  int (*get_led)(void *h, unsigned led, bool *state);
+  int (*set_led)(void *h, unsigned led, bool state);
+  int (*rumble)(void *h, bool on);
+} backend;
+
+// libxwiimote
+
+static void *iface_open(const void *arg, int flags)
+{
+  struct xwii_iface *iface;
+  int ret = xwii_iface_new(&iface, arg);
+  if (ret) {
+    errno = -ret;
+    return NULL;
+  }
+  ret = xwii_iface_open(iface, xwii_iface_available(iface) | flags);
+  if (ret) {
+    xwii_iface_unref(iface);
+    errno = -ret;
+    return NULL;
+  }
+  ret = xwii_iface_watch(iface, true);
+  if (ret) {
+    fprintf(stderr, "xwii_open: cannot initialize hotplug watch descriptor on interface '%s' err: %d\n",
+	    (const char*)arg, ret);
+  }
+  return iface;
+}
+
+static void iface_close(void *h)
+{
+  xwii_iface_close(h, xwii_iface_opened(h));
+  xwii_iface_unref(h);
+}
+
+static int iface_get_fd(void *h)
+{
+  return xwii_iface_get_fd(h);
+}
+
+static int iface_dispatch(void *h, struct xwii_event *event)
+{
+  return xwii_iface_dispatch(h, event, sizeof(*event));
+}
+
+static unsigned iface_available(void *h)
+{
+  return xwii_iface_available(h);
+}
+
+static unsigned iface_opened(void *h)
+{
+  return xwii_iface_opened(h);
+}
+
+static int iface_reopen(void *h)
+{
+  return xwii_iface_open(h, xwii_iface_available(h));
+}
+
+static int iface_get_battery(void *h, uint8_t *capacity)
+{
+  return xwii_iface_get_battery(h, capacity);
+}
+
+static int iface_get_led(void *h, unsigned led, bool *state)
+{
+  return xwii_iface_get_led(h, led, state);
+}
+
+static int iface_set_led(void *h, unsigned led, bool state)
+{
+  return xwii_iface_set_led(h, led, state);
+}
+
+static int iface_rumble(void *h, bool on)
+{
+  return xwii_iface_rumble(h, on);
+}
+
+static const backend iface_backend = {
+  "xwiimote", 1, iface_open, iface_close, iface_get_fd, iface_dispatch,
+  iface_available, iface_opened, iface_reopen, iface_get_battery,
+  iface_get_led, iface_set_led, iface_rumble
+};
+
+// Replayed logs. These have no battery, LEDs or rumble motor; the battery
+// and LEDs read as zero, and any settings are ignored.
+
+static void *rp_open(const void *arg, int flags)
+{
+  return replay_open(arg);
+}
+
+static void rp_close(void *h)
+{
+  replay_close(h);
+}
+
+static int rp_get_fd(void *h)
+{
+  return ((replay*)h)->fd;
+}
+
+static int rp_dispatch(void *h, struct xwii_event *event)
+{
+  return replay_next(h, event);
+}
+
+static unsigned rp_ifaces(void *h)
+{
+  return ((replay*)h)->ifaces;
+}
+
+static int rp_reopen(void *h)
+{
+  return 0;
+}
+
+static int rp_get_battery(void *h, uint8_t *capacity)
+{
+  *capacity = 0;
+  return 0;
+}
+
+static int rp_get_led(void *h, unsigned led, bool *state)
+{
+  *state = false;
+  return 0;
+}
+
+static int rp_set_led(void *h, unsigned led, bool state)
+{
+  return 0;
+}
+
+static int rp_rumble(void *h, bool on)
+{
+  return 0;
+}
+
+static const backend replay_backend = {
+  "replay", 0, rp_open, rp_close, rp_get_fd, rp_dispatch,
+  rp_ifaces, rp_ifaces, rp_reopen, rp_get_battery,
+  rp_get_led, rp_set_led, rp_rumble
+};
+
+// Mock devices. These have a full battery and remember their LED state.
+
+static void *mock_open_h(const void *arg, int flags)
+{
+  return mock_open(arg);
+}
+
+static void mock_close_h(void *h)
+{
+  mock_close(h);
+}
+
+static int mock_get_fd(void *h)
+{
+  return ((mock*)h)->fd;
+}
+
+static int mock_dispatch(void *h, struct xwii_event *event)
+{
+  return mock_next(h, event);
+}
+
+static unsigned mock_ifaces(void *h)
+{
+  return ((mock*)h)->ifaces;
+}
+
+static int mock_get_battery(void *h, uint8_t *capacity)
+{
+  *capacity = 100;
+  return 0;
+}
+
+static int mock_get_led(void *h, unsigned led, bool *state)
+{
+  *state = (((mock*)h)->leds >> (led-XWII_LED1)) & 1;
+  return 0;
+}
+
+static int mock_set_led(void *h, unsigned led, bool state)
+{
+  mock *m = h;
+  if (state)
+    m->leds |= 1 << (led-XWII_LED1);
+  else
+    m->leds &= ~(1 << (led-XWII_LED1));
+  return 0;
+}
+
+static int mock_reopen(void *h)
+{
+  return 0;
+}
+
+static int mock_rumble(void *h, bool on)
+{
+  return 0;
+}
+
+static const backend mock_backend = {
+  "mock", 0, mock_open_h, mock_close_h, mock_get_fd, mock_dispatch,
+  mock_ifaces, mock_ifaces, mock_reopen, mock_get_battery,
+  mock_get_led, mock_set_led, mock_rumble
+};
+
+// Latency instrumentation. If enabled, we keep two histograms per device:
+// the time from the kernel timestamp of each event to its delivery, i.e.,
+// the moment xwii_poll or xwii_poll_all processes it (which is when the
+// event or its motion data becomes visible to Lua), and the time from a
+// delivery to the next call of xwii_poll or xwii_poll_all (the next clock
+// tick, if the device is polled from a clock). Both are in usecs. The
+// histograms are log-scale with four buckets per octave (exact below 8
+// usecs), so the relative error is at most 25% over the whole range, and
+// updating them takes just a few instructions. They are written only by the
+// thread polling the device, using relaxed atomics, so that they can be
+// read at any time without locking. Events whose timestamps lie in the
+// future (which happens when replaying a log as fast as possible, or with
+// mock devices) have no meaningful latency; they are only counted, and
+// don't enter the histogram.
+
+#define LAT_BUCKETS 100 // up to 2^26 usecs, about a minute
+
+typedef struct {
+  _Atomic uint64_t count[LAT_BUCKETS];
+  _Atomic uint64_t n, sum, max;
+  _Atomic uint64_t ahead; // measurements skipped because they were negative
+} lathist;
+
+typedef struct {
+  int enabled;
+  lathist event; // kernel timestamp -> delivery
+  lathist tick; // delivery -> next poll
+  int64_t last; // time of the last delivery, 0 if none pending
+} latency;
+
+static inline int lat_bucket(uint64_t v)
+{
+  int e, i;
+  if (v < 8) return v;
+  e = 63 - __builtin_clzll(v);
+  i = 4*(e-1) + ((v >> (e-2)) & 3);
+  return i < LAT_BUCKETS ? i : LAT_BUCKETS-1;
+}
+
+// Smallest value in the given bucket.
+static inline uint64_t lat_lo(int i)
+{
+  int e = i/4+1;
+  return i < 8 ? (uint64_t)i : (uint64_t)(4 + i%4) << (e-2);
+}
+
+// Largest value in the given bucket.
+static inline uint64_t lat_hi(int i)
+{
+  return i < 8 ? (uint64_t)i : lat_lo(i) + ((uint64_t)1 << (i/4-1)) - 1;
+}
+
+// Single writer, so a relaxed load and store will do.
+static inline void lat_inc(_Atomic uint64_t *c, uint64_t k)
+{
+  atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + k,
+			memory_order_relaxed);
+}
+
+static inline void lathist_add(lathist *h, int64_t v)
+{
+  if (v < 0) {
+    lat_inc(&h->ahead, 1);
+    return;
+  }
+  lat_inc(&h->count[lat_bucket(v)], 1);
+  lat_inc(&h->n, 1);
+  lat_inc(&h->sum, v);
+  if ((uint64_t)v > atomic_load_explicit(&h->max, memory_order_relaxed))
+    atomic_store_explicit(&h->max, v, memory_order_relaxed);
+}
+
+// Value at the given quantile (upper bound of the bucket it falls into).
+static uint64_t lathist_quantile(lathist *h, double q)
+{
+  uint64_t n = atomic_load_explicit(&h->n, memory_order_relaxed), k = 0;
+  uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+  uint64_t want = ceil(q*n);
+  int i;
+  if (!n) return 0;
+  for (i = 0; i < LAT_BUCKETS; i++) {
+    k += atomic_load_explicit(&h->count[i], memory_order_relaxed);
+    if (k >= want)
+      return lat_hi(i) < max ? lat_hi(i) : max;
+  }
+  return max;
+}
+
+static void latency_reset(latency *l)
+{
+  memset(&l->event, 0, sizeof(l->event));
+  memset(&l->tick, 0, sizeof(l->tick));
+  l->last = 0;
+}
+
+// Called on each invocation of xwii_poll and xwii_poll_all, before waiting
+// for input: records the time since the last delivery, if any.
+static inline void latency_tick(latency *l)
+{
+  if (l->enabled && l->last) {
+    lathist_add(&l->tick, monotonic_time() - l->last);
+    l->last = 0;
+  }
+}
+
+// Called for each event delivered at the given time.
+static inline void latency_event(latency *l, int64_t now,
+				 const struct xwii_event *event)
+{
+  lathist_add(&l->event, now - event_time(event));
+  l->last = now;
+}
+
+// Device handles are full userdata objects with the following metatable.
+#define DEVHANDLE "xwiilua.device"
+
+typedef struct devhandle {
+  struct devhandle *next; // next open device
+  int num; // device number (used in diagnostics)
+  char *path; // device path
+  char *serial; // device serial (Bluetooth address), NULL if unknown
+  const backend *be; // device backend
+  void *h; // backend handle (struct xwii_iface* for live devices)
+  int fds_num; // number of file descriptors (1 if open, 0 otherwise)
+  struct pollfd fds[1]; // file descriptor used to poll the device
+  unsigned ifaces; // opened interfaces (cached value of xwii_iface_opened)
+  int threaded; // device is serviced by the reader thread
+  uint64_t rkey; // key of the device in the reader's epoll set
+  evring *ring; // event queue filled by the reader thread
+  // movement data (pro holds the two sticks of the Pro Controller, classic
+  // the two sticks and the analog triggers of the Classic Controller)
+  struct xwii_event_abs accel, motion, nunchuk_accel, nunchuk_stick,
+    ir[4], pro[2], board[4], classic[3];
+  // kernel timestamps of the movement data (monotonic time in usecs, 0 if
+  // we haven't seen any data yet)
+  int64_t stamp[NSENSORS];
+  // motion history (only used for the sensors reporting x, y, z triples)
+  history hist[NSENSORS];
+  // sensor fusion
+  fusion fus;
+  // calibration
+  calib cal;
+  // filter chains (NULL if no filters are configured)
+  filterchain *filt[NSENSORS];
+  // IR pointer
+  irpointer ptr;
+  // gesture recognizer (NULL if not used yet)
+  gestures *gest;
+  // triggers (NULL if not used yet)
+  triggers *trig;
+  // resamplers (NULL if resampling is disabled)
+  resampler *rs[NSENSORS];
+  // stick shaping for the Classic and Pro Controllers
+  stickshape classic_shape, pro_shape;
+  // Balance Board
+  board bb;
+  // guitar (stick, whammy bar, fret bar) and drums (stick, pads)
+  struct xwii_event_abs guitar[3], drums[XWII_DRUMS_ABS_NUM];
+  int64_t guitar_stamp, drums_stamp;
+  // velocity and time of the last hit of each drum pad
+  int drum_vel[XWII_DRUMS_ABS_NUM];
+  int64_t drum_time[XWII_DRUMS_ABS_NUM];
+  // synthetic key events
+  synthq synth;
+  // session recorder (NULL if not recording)
+  recorder *rec;
+  // latency histograms
+  latency lat;
+} devhandle;
+
+// List of all open devices.
+static devhandle *devices;
+
+// Check that the given argument is a device handle. Returns the handle; note
+// that the device may have been closed in the meantime, so the caller still
+// needs to check the fds_num field.
+static inline devhandle *check_dev(lua_State *L, int arg)
+{
+  return (devhandle*)luaL_checkudata(L, arg, DEVHANDLE);
+}
+
+// Device registry. Rather than enumerating the devices each time we need to
+// look up a device, we keep a persistent table of all known devices, in the
+// order in which they were discovered. It is kept up to date using a
+// non-blocking xwiimote hotplug monitor, whose first few results are the
+// devices already present in the system, followed by newly connected devices
+// as they appear. The monitor doesn't report devices which have been
+// removed, so we check for stale entries (devices whose sysfs directory has
+// vanished) when the table is updated. A hash table maps device paths to
+// their entries, so that looking up a device by its path is cheap.
+
+// All devices which are added to or removed from the registry are also
+// recorded in the hotplug log, which the application can read using
+// xwii_hotplug below. The monitor is also watched by the reader thread if it
+// is running, so that new devices are noticed right away. Since the registry
+// may thus be accessed from both the Lua thread and the reader thread, it is
+// protected by a lock. The lock is never held while calling into Lua (see
+// registry_copy below), so a device handle can't be garbage-collected (and
+// thus closed, which needs the lock as well) while we're holding it.
+
+typedef struct {
+  char *path; // device path
+  char *serial; // device serial (Bluetooth address), NULL if unknown
+  devhandle *dev; // the device handle if the device is open, NULL otherwise
+} regentry;
+
+static struct {
+  struct xwii_monitor *mon; // hotplug monitor
+  int fd; // monitor descriptor (non-blocking)
+  regentry *ent; // known devices
+  int n, size; // number of entries, allocated size
+  int *hash; // hash table (entry index+1, 0 = empty slot)
+  unsigned hsize; // size of the hash table (a power of 2)
+  pthread_mutex_t lock;
+} registry = { NULL, -1, NULL, 0, 0, NULL, 0, PTHREAD_MUTEX_INITIALIZER };
+
+// Size of the hotplug log (number of events).
+#define HOTPLUG_LOG 64
+
+static struct {
+  struct {
+    int added; // 1 = device was added, 0 = removed
+    char *path, *serial;
+  } ev[HOTPLUG_LOG];
+  uint64_t count; // total number of events so far
+} hotplug;
+
+static void hotplug_log(int added, const char *path, const char *serial)
+{
+  int i = hotplug.count % HOTPLUG_LOG;
+  free(hotplug.ev[i].path);
+  free(hotplug.ev[i].serial);
+  hotplug.ev[i].added = added;
+  hotplug.ev[i].path = strdup(path);
+  hotplug.ev[i].serial = serial ? strdup(serial) : NULL;
+  hotplug.count++;
+}
+
+// Read the serial of a device from its uevent file in sysfs. For the
+// Bluetooth devices we're dealing with, this is the Bluetooth address of the
+// device, which, unlike the device path, stays the same when the device
+// reconnects. Returns a string which must be freed by the caller, NULL if
+// the serial couldn't be determined.
+static char *read_serial(const char *path)
+{
+  char buf[256], *serial = NULL;
+  FILE *fp;
+  snprintf(buf, sizeof(buf), "%s/uevent", path);
+  if (!(fp = fopen(buf, "r"))) return NULL;
+  while (fgets(buf, sizeof(buf), fp)) {
+    if (strncmp(buf, "HID_UNIQ=", 9) == 0) {
+      buf[strcspn(buf, "\n")] = 0;
+      if (buf[9]) serial = strdup(buf+9);
+      break;
+    }
+  }
+  fclose(fp);
+  return serial;
+}
+
+static inline unsigned hash_path(const char *path)
+{
+  unsigned h = 2166136261u; // FNV-1a
+  while (*path) {
+    h ^= (unsigned char)*path++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Look up a device path. Returns the index of the entry, -1 if not found.
+static int registry_find(const char *path)
+{
+  unsigned i;
+  int k;
+  if (!registry.hsize) return -1;
+  for (i = hash_path(path) & (registry.hsize-1); (k = registry.hash[i]);
+       i = (i+1) & (registry.hsize-1))
+    if (strcmp(registry.ent[k-1].path, path) == 0)
+      return k-1;
+  return -1;
+}
+
+// Rebuild the hash table (after the table has grown or entries were
+// removed). The table is kept at most half full.
+static int registry_rehash(void)
+{
+  unsigned hsize = registry.hsize ? registry.hsize : 16;
+  int k;
+  while (hsize < 2*(unsigned)registry.n) hsize <<= 1;
+  if (hsize != registry.hsize) {
+    int *hash = realloc(registry.hash, hsize*sizeof(int));
+    if (!hash) return -1;
+    registry.hash = hash;
+    registry.hsize = hsize;
+  }
+  memset(registry.hash, 0, registry.hsize*sizeof(int));
+  for (k = 0; k < registry.n; k++) {
+    unsigned i = hash_path(registry.ent[k].path) & (registry.hsize-1);
+    while (registry.hash[i]) i = (i+1) & (registry.hsize-1);
+    registry.hash[i] = k+1;
+  }
+  return 0;
+}
+
+// Add a new device to the registry. Takes ownership of the path. Returns the
+// index of the entry, -1 if we're out of memory.
+static int registry_add(char *path)
+{
+  int k = registry_find(path);
+  if (k >= 0) {
+    free(path);
+    return k;
+  }
+  if (registry.n >= registry.size) {
+    int size = registry.size ? 2*registry.size : 8;
+    regentry *ent = realloc(registry.ent, size*sizeof(regentry));
+    if (!ent) {
+      free(path);
+      return -1;
+    }
+    registry.ent = ent;
+    registry.size = size;
+  }
+  k = registry.n++;
+  registry.ent[k].path = path;
+  registry.ent[k].serial = read_serial(path);
+  registry.ent[k].dev = NULL;
+  if (2*(unsigned)registry.n > registry.hsize) {
+    if (registry_rehash() < 0) {
+      registry.n--;
+      free(registry.ent[k].serial);
+      free(path);
+      return -1;
+    }
+  } else {
+    unsigned i = hash_path(path) & (registry.hsize-1);
+    while (registry.hash[i]) i = (i+1) & (registry.hsize-1);
+    registry.hash[i] = k+1;
+  }
+  hotplug_log(1, path, registry.ent[k].serial);
+  return k;
+}
+
+// Remove the entries for which the given predicate is true from the
+// registry, logging them in the hotplug log.
+static void registry_remove(int (*pred)(regentry *ent, void *data),
+			    void *data)
+{
+  int i, j;
+  for (i = j = 0; i < registry.n; i++) {
+    regentry *ent = &registry.ent[i];
+    if (pred(ent, data)) {
+      hotplug_log(0, ent->path, ent->serial);
+      free(ent->path);
+      free(ent->serial);
+    } else {
+      registry.ent[j++] = *ent;
+    }
+  }
+  if (j < registry.n) {
+    registry.n = j;
+    registry_rehash();
+  }
+}
+
+static int is_stale(regentry *ent, void *data)
+{
+  return !ent->dev && access(ent->path, F_OK) != 0;
+}
+
+static int is_path(regentry *ent, void *data)
+{
+  return strcmp(ent->path, (const char*)data) == 0;
+}
+
+// Read any pending devices from the hotplug monitor, creating the monitor if
+// needed. This never blocks.
+static void registry_poll(void)
+{
+  char *ent;
+  if (!registry.mon) {
+    registry.mon = xwii_monitor_new(true, false);
+    if (!registry.mon) {
+      fprintf(stderr, "xwii_list: cannot create monitor\n");
+      return;
+    }
+    registry.fd = xwii_monitor_get_fd(registry.mon, false);
+  }
+  while ((ent = xwii_monitor_poll(registry.mon)))
+    registry_add(ent);
+}
+
+// Update the registry: read new devices from the monitor and get rid of the
+// devices which have been removed (unless they're still open).
+static void registry_update(void)
+{
+  registry_poll();
+  registry_remove(is_stale, NULL);
+}
+
+static void registry_free(void)
+{
+  int i;
+  pthread_mutex_lock(&registry.lock);
+  if (registry.mon) xwii_monitor_unref(registry.mon);
+  registry.mon = NULL;
+  registry.fd = -1;
+  for (i = 0; i < registry.n; i++) {
+    free(registry.ent[i].path);
+    free(registry.ent[i].serial);
+  }
+  free(registry.ent);
+  free(registry.hash);
+  registry.ent = NULL;
+  registry.hash = NULL;
+  registry.n = registry.size = 0;
+  registry.hsize = 0;
+  for (i = 0; i < HOTPLUG_LOG; i++) {
+    free(hotplug.ev[i].path);
+    free(hotplug.ev[i].serial);
+  }
+  memset(&hotplug, 0, sizeof(hotplug));
+  pthread_mutex_unlock(&registry.lock);
+}
+
+// Copy data out of the registry, so that it can be turned into Lua values
+// after releasing the lock (the Lua API may raise an error, which must not
+// happen while we're holding the lock). The copy callback is invoked with the
+// lock held; it returns the number of bytes it needs, and copies the data to
+// the given buffer if it's large enough. The buffer is allocated as a Lua
+// userdata, which is left on the stack, so that it gets freed in any case.
+// Returns the buffer (which may be NULL if no bytes are needed).
+static char *registry_copy(lua_State *L,
+			   size_t (*copy)(char *buf, size_t size, void *data),
+			   void *data)
+{
+  char *buf = NULL;
+  size_t size = 0, need;
+  while (1) {
+    pthread_mutex_lock(&registry.lock);
+    need = copy(buf, size, data);
+    pthread_mutex_unlock(&registry.lock);
+    if (need <= size) return buf;
+    // the registry may change in the meantime, so try again
+    if (buf) lua_pop(L, 1);
+    buf = lua_newuserdata(L, need);
+    size = need;
+  }
+}
+
+// Optional background reader thread. If enabled (see xwii_reader below), a
+// single thread waits for input on all open devices using epoll, reads the
+// events from the devices and stores them in each device's event queue. The
+// xwii_poll function then only takes already decoded events from the queue,
+// so the system calls and the kernel wakeups don't happen on the Lua (Pd)
+// thread any more. The lock is held by the reader thread while it services a
+// device, and by the Lua side while it adds or removes a device or accesses
+// the interface of a device serviced by the reader (see dev_lock below).
+
+// The epoll set doesn't refer to the devices directly, since a device may be
+// released by the Lua side after epoll_wait returned an event for it, but
+// before the reader thread gets hold of the lock. Instead, each device is
+// entered into a slot of the dev table below, and the epoll key consists of
+// the slot number (low 32 bits) and a generation number (high 32 bits) which
+// is bumped each time a slot is reused. The reader thread looks up the key
+// with the lock held, and ignores it if the slot has been cleared or reused
+// in the meantime. Key 0 denotes the wakefd and key 1 the hotplug monitor.
+
+#define READER_WAKE 0
+#define READER_MONITOR 1
+
+static struct {
+  int running; // reader thread is running
+  pthread_t thread;
+  int epfd; // epoll descriptor for all devices serviced by the reader
+  int wakefd; // eventfd used to stop the reader thread
+  pthread_mutex_t lock;
+  devhandle **dev; // devices serviced by the reader, indexed by slot
+  unsigned ndev; // size of the dev table
+  uint32_t gen; // last generation number
+} reader = { 0, 0, -1, -1, PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 };
+
+static evring *ring_new(void)
+{
+  evring *r = calloc(1, sizeof(evring));
+  if (!r) return NULL;
+  r->notify = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+  if (r->notify < 0) {
+    free(r);
+    return NULL;
+  }
+  return r;
+}
+
+static void ring_free(evring *r)
+{
+  if (r) {
+    close(r->notify);
+    free(r);
+  }
+}
+
+static inline int ring_empty(evring *r)
+{
+  return atomic_load_explicit(&r->head, memory_order_acquire) ==
+    atomic_load_explicit(&r->tail, memory_order_relaxed);
+}
+
+// Consumer side: take the next event from the queue. Returns 1 if an event
+// was available, 0 otherwise.
+static inline int ring_pop(evring *r, struct xwii_event *event)
+{
+  unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  if (atomic_load_explicit(&r->head, memory_order_acquire) == tail)
+    return 0;
+  *event = r->buf[tail & (RINGSIZE-1)];
+  atomic_store_explicit(&r->tail, tail+1, memory_order_release);
+  return 1;
+}
+
+// The device interfaces aren't thread-safe, so while a device is serviced
+// by the reader thread, all other calls on its interface from the Lua side
+// (setting the LEDs, reopening the interface, etc.) must hold the reader
+// lock, too. These are no-ops if the device is read directly.
+static inline void dev_lock(devhandle *d)
+{
+  if (d->threaded) pthread_mutex_lock(&reader.lock);
+}
+
+static inline void dev_unlock(devhandle *d)
+{
+  if (d->threaded) pthread_mutex_unlock(&reader.lock);
+}
+
+// Reopen the available interfaces of a device after a hotplug event (e.g.,
+// when an extension like the Nunchuk is plugged in). This is always done on
+// the Lua side when the WATCH event is processed, even in threaded mode.
+static void reopen_iface(devhandle *d, const char *who)
+{
+  int ret;
+  dev_lock(d);
+  ret = d->be->reopen(d->h);
+  d->ifaces = d->be->opened(d->h);
+  dev_unlock(d);
+  if (ret)
+    fprintf(stderr, "%s: cannot open interface #%d err: %d\n", who, d->num, ret);
+  else
+    fprintf(stderr, "%s: hotplug event on interface #%d\n", who, d->num);
+}
+
+// Producer side: read all pending events from the device into its queue.
+// The events are read directly into the free queue slots, so no extra
+// copying is involved. If the queue is full, events are dropped (and
+// counted). The last slot is reserved for the GONE event, so that the
+// consumer always gets to see it. Returns 0 if the device is still alive, -1
+// if the device was removed or can't be read any more, in which case the
+// caller should stop watching it. This is called with the reader lock held.
+static int reader_drain(devhandle *d)
+{
+  evring *r = d->ring;
+  int n = 0, ret = 0;
+  while (1) {
+    struct xwii_event scratch, *event;
+    unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    int full = head - atomic_load_explicit(&r->tail, memory_order_acquire)
+      >= RINGSIZE-1;
+    event = full ? &scratch : &r->buf[head & (RINGSIZE-1)];
+    ret = d->be->dispatch(d->h, event);
+    if (ret) {
+      if (ret != -EAGAIN) {
+	fprintf(stderr, "xwii_reader: read failed on device #%d err:%d\n",
+		d->num, ret);
+      }
+      break;
+    }
+    if (full) {
+      if (event->type != XWII_EVENT_GONE) {
+	atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+	continue;
+      }
+      r->buf[head & (RINGSIZE-1)] = *event;
+    }
+    atomic_store_explicit(&r->head, head+1, memory_order_release);
+    n++;
+    if (event->type == XWII_EVENT_GONE) {
+      ret = -ENODEV;
+      break;
+    }
+  }
+  if (n > 0) {
+    // wake up the consumer if it's waiting for input (this pairs with the
+    // fence in wait_input below)
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&r->waiting)) {
+      uint64_t one = 1;
+      if (write(r->notify, &one, sizeof(one)) < 0) {
+	// the counter can't overflow in practice, ignore
+      }
+    }
+  }
+  return (ret == 0 || ret == -EAGAIN) ? 0 : -1;
+}
+
+// Look up the device with the given epoll key. Returns NULL if the device
+// has been removed from the reader in the meantime. This must be called with
+// the reader lock held.
+static inline devhandle *reader_lookup(uint64_t key)
+{
+  uint32_t slot = (uint32_t)key;
+  devhandle *d = slot < reader.ndev ? reader.dev[slot] : NULL;
+  return d && d->rkey == key ? d : NULL;
+}
+
+static void *reader_main(void *arg)
+{
+  struct epoll_event evs[16];
+  while (1) {
+    int i, n = epoll_wait(reader.epfd, evs, 16, -1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "xwii_reader: epoll_wait failed err:%d\n", -errno);
+      break;
+    }
+    for (i = 0; i < n; i++) {
+      uint64_t key = evs[i].data.u64;
+      devhandle *d;
+      if (key == READER_WAKE) return NULL; // we've been asked to quit
+      if (key == READER_MONITOR) {
+	// hotplug monitor, read new devices
+	pthread_mutex_lock(&registry.lock);
+	registry_poll();
+	pthread_mutex_unlock(&registry.lock);
+	continue;
+      }
+      pthread_mutex_lock(&reader.lock);
+      if ((d = reader_lookup(key)) && reader_drain(d) < 0) {
+	// device is gone, stop watching it
+	epoll_ctl(reader.epfd, EPOLL_CTL_DEL, d->fds[0].fd, NULL);
+      }
+      pthread_mutex_unlock(&reader.lock);
+    }
+  }
+  return NULL;
+}
+
+// Find a free slot in the dev table, enlarging the table as needed. Returns
+// the slot number, or -1 if we run out of memory. This must be called with
+// the reader lock held.
+static int reader_slot(void)
+{
+  unsigned i, n;
+  devhandle **dev;
+  for (i = 0; i < reader.ndev; i++)
+    if (!reader.dev[i]) return i;
+  n = reader.ndev ? 2*reader.ndev : 8;
+  if (!(dev = realloc(reader.dev, n*sizeof(devhandle*)))) return -1;
+  memset(dev+reader.ndev, 0, (n-reader.ndev)*sizeof(devhandle*));
+  reader.dev = dev;
+  reader.ndev = n;
+  return i;
+}
+
+// Hand a device over to the reader thread. Returns 0 on success, -1 if the
+// device can't be serviced by the reader (it is then read directly).
+static int reader_add(devhandle *d)
+{
+  struct epoll_event ev;
+  int slot;
+  // only live devices are read by the reader thread
+  if (!reader.running || d->threaded || !d->be->live) return 0;
+  if (!d->ring && !(d->ring = ring_new())) {
+    fprintf(stderr, "xwii_reader: cannot allocate event queue for device #%d\n", d->num);
+    return -1;
+  }
+  pthread_mutex_lock(&reader.lock);
+  if ((slot = reader_slot()) < 0) {
+    fprintf(stderr, "xwii_reader: out of memory\n");
+    pthread_mutex_unlock(&reader.lock);
+    return -1;
+  }
+  // generation 0 is reserved for the wakefd and the hotplug monitor
+  if (++reader.gen == 0) reader.gen = 1;
+  d->rkey = (uint64_t)reader.gen << 32 | (unsigned)slot;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.u64 = d->rkey;
+  if (epoll_ctl(reader.epfd, EPOLL_CTL_ADD, d->fds[0].fd, &ev) < 0) {
+    fprintf(stderr, "xwii_reader: cannot watch device #%d err:%d\n", d->num, -errno);
+    pthread_mutex_unlock(&reader.lock);
+    return -1;
+  }
+  reader.dev[slot] = d;
+  d->threaded = 1;
+  pthread_mutex_unlock(&reader.lock);
+  return 0;
+}
+
+// Take a device away from the reader thread. Any events still in the queue
+// will be consumed by xwii_poll before the device is read directly again.
+// Once this returns, the reader thread won't touch the device any more, even
+// if it still has a pending event for it (see reader_lookup above).
+static void reader_remove(devhandle *d)
+{
+  if (!d->threaded) return;
+  pthread_mutex_lock(&reader.lock);
+  // this may fail if the reader already stopped watching the device, ignore
+  epoll_ctl(reader.epfd, EPOLL_CTL_DEL, d->fds[0].fd, NULL);
+  reader.dev[(uint32_t)d->rkey] = NULL;
+  d->threaded = 0;
+  pthread_mutex_unlock(&reader.lock);
+}
+
+static int reader_start(void)
+{
+  struct epoll_event ev;
+  devhandle *d;
+  int ret;
+  if (reader.running) return 0;
+  reader.epfd = epoll_create1(EPOLL_CLOEXEC);
+  reader.wakefd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.u64 = READER_WAKE;
+  if (reader.epfd < 0 || reader.wakefd < 0 ||
+      epoll_ctl(reader.epfd, EPOLL_CTL_ADD, reader.wakefd, &ev) < 0) {
+    fprintf(stderr, "xwii_reader: cannot create epoll descriptor err:%d\n", -errno);
+    goto fail;
+  }
+  // watch the hotplug monitor
+  pthread_mutex_lock(&registry.lock);
+  registry_poll();
+  if (registry.fd >= 0) {
+    ev.data.u64 = READER_MONITOR;
+    if (epoll_ctl(reader.epfd, EPOLL_CTL_ADD, registry.fd, &ev) < 0)
+      fprintf(stderr, "xwii_reader: cannot watch hotplug monitor err:%d\n", -errno);
+  }
+  pthread_mutex_unlock(&registry.lock);
+  ret = pthread_create(&reader.thread, NULL, reader_main, NULL);
+  if (ret) {
+    fprintf(stderr, "xwii_reader: cannot create reader thread err:%d\n", -ret);
+    goto fail;
+  }
+  reader.running = 1;
+  for (d = devices; d; d = d->next)
+    reader_add(d);
+  return 0;
+ fail:
+  if (reader.epfd >= 0) close(reader.epfd);
+  if (reader.wakefd >= 0) close(reader.wakefd);
+  reader.epfd = reader.wakefd = -1;
+  return -1;
+}
+
+static void reader_stop(void)
+{
+  uint64_t one = 1;
+  devhandle *d;
+  if (!reader.running) return;
+  for (d = devices; d; d = d->next)
+    reader_remove(d);
+  if (write(reader.wakefd, &one, sizeof(one)) < 0) {
+    fprintf(stderr, "xwii_reader: cannot wake reader thread err:%d\n", -errno);
+  }
+  pthread_join(reader.thread, NULL);
+  close(reader.epfd);
+  close(reader.wakefd);
+  reader.epfd = reader.wakefd = -1;
+  free(reader.dev);
+  reader.dev = NULL;
+  reader.ndev = 0;
+  reader.running = 0;
+}
+
+// Start (nonzero/true argument) or stop (zero/false) the background reader
+// thread. This affects all devices, including those which are opened
+// later. Returns true if the reader thread is running afterwards. Without an
+// argument, this just returns the current status.
+static int l_xwii_reader(lua_State *L)
+{
+  if (!lua_isnoneornil(L, 1)) {
+    int flag = lua_isnumber(L, 1) ? lua_tointeger(L, 1) != 0 :
+      lua_toboolean(L, 1);
+    if (flag)
+      reader_start();
+    else
+      reader_stop();
+  }
+  lua_pushboolean(L, reader.running);
+  return 1;
+}
+
+// Copy the device paths for xwii_list (a sequence of NUL-terminated strings;
+// the number of devices is stored in *data).
+static size_t list_copy(char *buf, size_t size, void *data)
+{
+  size_t need = 0;
+  int i;
+  registry_update();
+  for (i = 0; i < registry.n; i++)
+    need += strlen(registry.ent[i].path)+1;
+  if (need <= size) {
+    for (i = 0; i < registry.n; i++) {
+      strcpy(buf, registry.ent[i].path);
+      buf += strlen(buf)+1;
+    }
+    *(int*)data = registry.n;
+  }
+  return need;
+}
+
+// Return a table with the names of the devices known to the system.
+static int l_xwii_list(lua_State *L)
+{
+  int i, n = 0;
+  const char *p = registry_copy(L, list_copy, &n);
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; i++) {
+    lua_pushstring(L, p);
+    lua_rawseti(L, -2, i+1);
+    p += strlen(p)+1;
+  }
+  return 1;
+}
+
+// Release all resources associated with a device and remove it from the list
+// of open devices. This is invoked when the device is closed (explicitly or
+// when its handle is garbage-collected), or when the device was removed.
+static void dev_release(devhandle *d)
+{
+  devhandle **p;
+  int i;
+  if (!d->fds_num) return;
+  reader_remove(d);
+  d->be->close(d->h);
+  d->h = NULL;
+  ring_free(d->ring);
+  d->ring = NULL;
+  for (i = 0; i < NSENSORS; i++) {
+    history_free(&d->hist[i]);
+    free(d->filt[i]);
+    d->filt[i] = NULL;
+    free(d->rs[i]);
+    d->rs[i] = NULL;
+  }
+  gestures_free(d->gest);
+  d->gest = NULL;
+  if (d->rec) {
+    int err = recorder_stop(d->rec);
+    if (err)
+      fprintf(stderr, "xwii_record: write error on device #%d err:%d\n",
+	      d->num, -err);
+    free(d->rec);
+    d->rec = NULL;
+  }
+  free(d->trig);
+  d->trig = NULL;
+  for (p = &devices; *p; p = &(*p)->next)
+    if (*p == d) {
+      *p = d->next;
+      break;
+    }
+  pthread_mutex_lock(&registry.lock);
+  if ((i = registry_find(d->path)) >= 0 && registry.ent[i].dev == d)
+    registry.ent[i].dev = NULL;
+  pthread_mutex_unlock(&registry.lock);
+  free(d->path);
+  free(d->serial);
+  d->path = d->serial = NULL;
+  d->fds[0].fd = -1;
+  d->fds[0].events = 0;
+  d->fds_num = 0;
+}
+
+// Create the handle of a device and push it on the Lua stack. The handle is
+// closed initially; this is done before opening the device, since the Lua
+// API may raise an error (out of memory), which must not happen while we're
+// holding a lock or an open device which isn't owned by a handle yet.
+static devhandle *dev_new(lua_State *L)
+{
+  devhandle *d = (devhandle*)lua_newuserdata(L, sizeof(devhandle));
+  memset(d, 0, sizeof(devhandle));
+  luaL_setmetatable(L, DEVHANDLE);
+  d->fds[0].fd = -1;
+  return d;
+}
+
+// Attach a device which has been opened with the given backend to a handle
+// created with dev_new. The path and serial are taken over by the device
+// handle. This doesn't use the Lua API, so it may be called with a lock held.
+static void dev_attach(devhandle *d, const backend *be, void *h, int num,
+		       char *path, char *serial)
+{
+  d->num = num;
+  d->path = path;
+  d->serial = serial;
+  d->be = be;
+  d->h = h;
+  d->ifaces = be->opened(h);
+  d->fds[0].fd = be->get_fd(h);
+  d->fds[0].events = POLLIN;
+  d->fds_num = 1;
+  d->next = devices;
+  devices = d;
+}
+
+// Open the device with the given registry entry and attach it to the given
+// handle. Returns 0 if the device was opened, -1 otherwise. This must be
+// called with the registry lock held. The caller hands the device over to
+// the reader thread (see reader_add) after releasing the lock.
+static int open_dev(devhandle *d, int k, const char *who)
+{
+  const char *path = registry.ent[k].path;
+  void *h;
+  char *dpath, *serial = NULL;
+  if (registry.ent[k].dev) // device is already open
+    return -1;
+  if (!(dpath = strdup(path)) ||
+      (registry.ent[k].serial && !(serial = strdup(registry.ent[k].serial)))) {
+    fprintf(stderr, "%s: out of memory\n", who);
+    free(dpath);
+    return -1;
+  }
+  if (!(h = iface_backend.open(path, XWII_IFACE_WRITABLE))) {
+    fprintf(stderr, "%s: cannot open interface '%s' err: %d\n",
+	    who, path, -errno);
+    free(dpath);
+    free(serial);
+    return -1;
+  }
+  dev_attach(d, &iface_backend, h, k+1, dpath, serial);
+  registry.ent[k].dev = d;
+  return 0;
+}
+
+// Finish opening a device. The handle created by dev_new is on top of the
+// Lua stack; if the device couldn't be opened (ret < 0), it is replaced with
+// nil. Must be called without holding the registry lock.
+static void opened_dev(lua_State *L, devhandle *d, int ret)
+{
+  if (ret < 0) {
+    lua_pop(L, 1);
+    lua_pushnil(L);
+  } else {
+    reader_add(d);
+  }
+}
+
+// Open the device given its index (1-based) in the list of devices known to
+// the system. Returns the device handle if the device can be opened, nil
+// otherwise. In the current implementation, each device can only be opened
+// once; if the device is already open, nil is returned instead, indicating
+// failure. The device handle is an object which can be passed to the
+// functions below, which are also available as methods of the object (with
+// the xwii_ prefix removed, e.g., dev:poll() or dev:accel()). The device is
+// closed automatically when the handle is garbage-collected (or goes out of
+// scope if it is declared as a to-be-closed variable in Lua 5.4).
+static int l_xwii_open(lua_State *L)
+{
+  int num = (int)luaL_checknumber(L, 1), ret = -1;
+  devhandle *d = dev_new(L);
+  pthread_mutex_lock(&registry.lock);
+  registry_update();
+  if (num < 1 || num > registry.n)
+    fprintf(stderr, "xwii_open: cannot find device #%d\n", num);
+  else
+    ret = open_dev(d, num-1, "xwii_open");
+  pthread_mutex_unlock(&registry.lock);
+  opened_dev(L, d, ret);
+  return 1;
+}
+
+// Open the device with the given path (as reported by xwii_list). This is
+// the preferred way to reopen a device, since the device numbers change as
+// devices come and go. As the registry of known devices is kept up to date
+// incrementally, this usually amounts to a simple table lookup.
+static int l_xwii_open_path(lua_State *L)
+{
+  const char *path = luaL_checkstring(L, 1);
+  devhandle *d = dev_new(L);
+  int k, ret = -1;
+  pthread_mutex_lock(&registry.lock);
+  k = registry_find(path);
+  if (k < 0) {
+    // not seen yet, check for new devices
+    registry_poll();
+    k = registry_find(path);
+  }
+  if (k < 0 && access(path, F_OK) == 0) {
+    // the device exists, but the monitor doesn't know about it (this
+    // shouldn't normally happen), add it anyway
+    char *p = strdup(path);
+    k = p ? registry_add(p) : -1;
+  }
+  if (k < 0)
+    fprintf(stderr, "xwii_open_path: cannot find device '%s'\n", path);
+  else
+    ret = open_dev(d, k, "xwii_open_path");
+  pthread_mutex_unlock(&registry.lock);
+  opened_dev(L, d, ret);
+  return 1;
+}
+
+// Return the path and the serial (Bluetooth address) of a device, or nil if
+// the device isn't open. The serial may be nil if it's not known.
+static int l_xwii_path(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  if (!d->path) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_pushstring(L, d->path);
+  if (d->serial)
+    lua_pushstring(L, d->serial);
+  else
+    lua_pushnil(L);
+  return 2;
+}
+
+// Snapshot of the hotplug log for xwii_hotplug, see hotplug_copy below.
+typedef struct {
+  int since_given; // cursor given by the caller
+  lua_Integer since; // cursor (input)
+  uint64_t count; // new cursor (output)
+  int n; // number of events copied (output)
+} hotplug_query;
+
+// Copy the events of the hotplug log since the given cursor (a type byte
+// followed by the path and the serial as NUL-terminated strings, an empty
+// serial meaning unknown).
+static size_t hotplug_copy(char *buf, size_t size, void *data)
+{
+  hotplug_query *q = data;
+  uint64_t start, since, i;
+  size_t need = 0;
+  // check for new and removed devices
+  registry_update();
+  start = hotplug.count > HOTPLUG_LOG ? hotplug.count - HOTPLUG_LOG : 0;
+  since = !q->since_given || q->since < 0 ||
+    (uint64_t)q->since > hotplug.count ? hotplug.count : (uint64_t)q->since;
+  if (since > start) start = since;
+  for (i = start; i < hotplug.count; i++) {
+    int j = i % HOTPLUG_LOG;
+    need += strlen(hotplug.ev[j].path) + 3 +
+      (hotplug.ev[j].serial ? strlen(hotplug.ev[j].serial) : 0);
+  }
+  if (need <= size) {
+    for (i = start; i < hotplug.count; i++) {
+      int j = i % HOTPLUG_LOG;
+      *buf++ = hotplug.ev[j].added;
+      strcpy(buf, hotplug.ev[j].path);
+      buf += strlen(buf)+1;
+      strcpy(buf, hotplug.ev[j].serial ? hotplug.ev[j].serial : "");
+      buf += strlen(buf)+1;
+    }
+    q->count = hotplug.count;
+    q->n = hotplug.count - start;
+  }
+  return need;
+}
+
+// Report devices which have been connected or removed. The argument is a
+// cursor, as returned by the previous invocation; if it is omitted, no
+// events are returned, only the current cursor, so that you can start
+// tracking hotplug events from this point on. Returns a table with the
+// events since the given cursor, and the new cursor. Each event is a table
+// with the fields type ("add" or "remove"), path and serial (the Bluetooth
+// address of the device if known, which stays the same when a device
+// reconnects, whereas the path usually changes). If the second argument is
+// true, newly connected devices are opened automatically, and the device
+// handle is returned in the dev field of the corresponding event. Only the
+// last 64 events are kept, so this should be called on a regular basis.
+static int l_xwii_hotplug(lua_State *L)
+{
+  hotplug_query q;
+  int autoopen = lua_toboolean(L, 2), i;
+  const char *p;
+  q.since_given = !lua_isnoneornil(L, 1);
+  q.since = q.since_given ? luaL_checkinteger(L, 1) : 0;
+  p = registry_copy(L, hotplug_copy, &q);
+  lua_createtable(L, q.n, 0);
+  for (i = 0; i < q.n; i++) {
+    int added = *p++;
+    const char *path = p, *serial = p + strlen(p)+1;
+    p = serial + strlen(serial)+1;
+    lua_createtable(L, 0, 4);
+    lua_pushstring(L, added ? "add" : "remove");
+    lua_setfield(L, -2, "type");
+    lua_pushstring(L, path);
+    lua_setfield(L, -2, "path");
+    if (*serial) {
+      lua_pushstring(L, serial);
+      lua_setfield(L, -2, "serial");
+    }
+    if (autoopen && added) {
+      devhandle *d = dev_new(L);
+      int k, ret = -1;
+      pthread_mutex_lock(&registry.lock);
+      if ((k = registry_find(path)) >= 0)
+	ret = open_dev(d, k, "xwii_hotplug");
+      pthread_mutex_unlock(&registry.lock);
+      opened_dev(L, d, ret);
+      lua_setfield(L, -2, "dev");
+    }
+    lua_rawseti(L, -2, i+1);
+  }
+  lua_pushinteger(L, q.count);
+  return 2;
+}
+
+// Close the device given by its handle. This never fails and doesn't return
+// anything.
+static int l_xwii_close(lua_State *L)
+{
+  devhandle *d = (devhandle*)luaL_testudata(L, 1, DEVHANDLE);
+  if (d) dev_release(d);
+  return 0;
+}
+
+static int l_xwii_gc(lua_State *L)
+{
+  dev_release(check_dev(L, 1));
+  return 0;
+}
+
+static int l_xwii_tostring(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  if (d->fds_num)
+    lua_pushfstring(L, "xwii device #%d (%s)", d->num, d->path);
+  else
+    lua_pushfstring(L, "xwii device #%d (closed)", d->num);
+  return 1;
+}
+
+// Check which interfaces the device supports. This is a bitmask, see
+// xwii_iface_type in the xwiimote.h header file for possible values.
+static int l_xwii_info(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  if (d->fds_num) {
+    unsigned ifaces;
+    dev_lock(d);
+    ifaces = d->be->available(d->h);
+    dev_unlock(d);
+    lua_pushinteger(L, ifaces);
+  } else {
+    lua_pushinteger(L, 0);
+  }
+  return 1;
+}
+
+// Retrieve the battery capacity (unsigned 8 bit value).
+static int l_xwii_get_battery(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  if (d->fds_num) {
+    uint8_t capacity;
+    int ret;
+    dev_lock(d);
+    ret = d->be->get_battery(d->h, &capacity);
+    dev_unlock(d);
+    if (ret) {
+      fprintf(stderr, "xwii_get_battery: cannot read battery capacity\n");
+      lua_pushnil(L);
+    } else {
+      lua_pushinteger(L, capacity);
+    }
+  } else {
+    lua_pushinteger(L, 0);
+  }
+  return 1;
+}
+
+// Retrieve the status of the 4 LEDs as a bitmask.
+static int l_xwii_get_leds(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  if (d->fds_num) {
+    uint8_t mask = 0;
+    int i, ret = 0;
+    dev_lock(d);
+    for (i = ret = 0; i < 4 && !ret; i++) {
+      bool flag;
+      ret = d->be->get_led(d->h, XWII_LED(i+1), &flag);
+      if (!ret && flag) mask |= 1<<i;
+    }
+    dev_unlock(d);
+    if (ret) {
+      fprintf(stderr, "xwii_get_leds: cannot read LED state\n");
+      lua_pushnil(L);
+    } else {
+      lua_pushinteger(L, mask);
+    }
+  } else {
+    lua_pushinteger(L, 0);
+  }
+  return 1;
+}
+
+// Set the status of the 4 LEDs from a bitmask.
+static int l_xwii_set_leds(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  uint8_t mask = (uint8_t)luaL_checknumber(L, 2);
+  if (d->fds_num) {
+    int i, ret = 0;
+    dev_lock(d);
+    for (i = 0; i < 4 && !ret; i++) {
+      bool flag = !!(mask & (1<<i));
+      ret = d->be->set_led(d->h, XWII_LED(i+1), flag);
+    }
+    dev_unlock(d);
+    if (ret)
+      fprintf(stderr, "xwii_set_leds: cannot write LED state\n");
+  }
+  return 0;
+}
+
+// Set the status of the rumble motor (0 = off, nonzero = on).
+static int l_xwii_rumble(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  int flag = (int)luaL_checknumber(L, 2);
+  if (d->fds_num) {
+    int ret;
+    dev_lock(d);
+    ret = d->be->rumble(d->h, !!flag);
+    dev_unlock(d);
+    if (ret) {
+      fprintf(stderr, "xwii_rumble: cannot set rumble motor state\n");
+    }
+  }
+  return 0;
+}
+
+// Fetch the next event of a device. If the device is serviced by the reader
+// thread (or there are still events left over from it), the event is taken
+// from the device's event queue, otherwise it is read directly from the
+// device. Returns 0 if an event was read, -EAGAIN if there are no more
+// events, and some other negative error code otherwise.
+static inline int next_event(devhandle *d, struct xwii_event *event)
+{
+  if (d->ring && ring_pop(d->ring, event)) return 0;
+  if (d->threaded) return -EAGAIN;
+  return d->be->dispatch(d->h, event);
+}
+
+// Wait for input on a device for at most the given number of msecs (zero
+// means don't wait at all, negative means wait indefinitely). Returns a
+// positive value if input is available, 0 on timeout and a negative value
+// on error. In threaded mode, this checks the device's event queue and, if
+// needed, sleeps on the queue's notify descriptor, so that no system calls
+// are needed if the timeout is zero.
+static int wait_input(devhandle *d, int timeout)
+{
+  evring *r = d->ring;
+  uint64_t val;
+  int ret;
+  if (r && !ring_empty(r)) return 1;
+  if (!d->threaded) return poll(d->fds, d->fds_num, timeout);
+  if (timeout == 0) return 0;
+  atomic_store(&r->waiting, 1);
+  // get rid of stale notifications before checking the queue again (this
+  // pairs with the fence in reader_drain above)
+  if (read(r->notify, &val, sizeof(val)) < 0) {
+    // EAGAIN, nothing to clear
+  }
+  atomic_thread_fence(memory_order_seq_cst);
+  if (!ring_empty(r)) {
+    ret = 1;
+  } else {
+    struct pollfd pfd = { r->notify, POLLIN, 0 };
+    ret = poll(&pfd, 1, timeout);
+    if (ret > 0) ret = !ring_empty(r);
+  }
+  atomic_store(&r->waiting, 0);
+  return ret;
+}
+
+// Run the filter chain of a sensor (if any) on the given event data.
+static inline void filter_sensor(devhandle *d, int sensor,
+				 struct xwii_event_abs *a,
+				 const struct xwii_event *event)
+{
+  if (d->filt[sensor])
+    filter_run(d->filt[sensor], a, sensor_nvals[sensor]/sensor_dim[sensor],
+	       sensor_dim[sensor], event_time(event), sensor == SENSOR_IR);
+}
+
+// Feed the (calibrated and filtered) data of a motion sensor into the
+// processing stages which may generate synthetic key events: the gesture
+// recognizer, if enabled and the sensor is its source, and the triggers
+// watching the sensor. Also feeds the resampler of the sensor, if any.
+static inline void sensor_hooks(devhandle *d, int sensor,
+				const struct xwii_event_abs *a, int64_t t)
+{
+  if (d->gest && d->gest->enabled && d->gest->source == sensor)
+    gesture_feed(d->gest, a, t, &d->synth);
+  if (d->trig) {
+    int i;
+    for (i = 0; i < d->trig->n; i++)
+      if (d->trig->t[i].sensor == sensor)
+	trigger_eval(&d->trig->t[i], a, t, &d->synth);
+  }
+  if (d->rs[sensor])
+    resample_abs(d->rs[sensor], a, t);
+}
+
+// Drum pads report the pressure of a hit (1-7), which drops back to zero
+// afterwards. A rise from zero to a nonzero value is a hit, which is
+// reported as a synthetic key event right away, with the pressure scaled to
+// a MIDI-style velocity (1-127). If the pressure keeps rising during the
+// same strike, no further hits are reported, but the velocity returned by
+// xwii_drums is raised to the peak until the pad returns to zero.
+static void drums_update(devhandle *d, const struct xwii_event_abs *abs,
+			 int64_t t)
+{
+  int i;
+  d->drums[XWII_DRUMS_ABS_PAD] = abs[XWII_DRUMS_ABS_PAD];
+  for (i = XWII_DRUMS_ABS_PAD+1; i < XWII_DRUMS_ABS_NUM; i++) {
+    int32_t p = abs[i].x;
+    int vel = p >= 7 ? 127 : (p*127+3)/7;
+    if (p > 0 && d->drums[i].x <= 0) {
+      d->drum_vel[i] = vel;
+      d->drum_time[i] = t;
+      synth_push(&d->synth, CODE_DRUM + i, vel, t);
+    } else if (p > 0 && vel > d->drum_vel[i]) {
+      d->drum_vel[i] = vel;
+    }
+    d->drums[i] = abs[i];
+  }
+  d->drums_stamp = t;
+}
+
+// Process an event read from the device, updating the motion data as
+// needed. Returns 1 for key events (which need to be reported to the
+// caller), -1 if the device is gone, and 0 otherwise.
+static int handle_event(devhandle *d, struct xwii_event *event)
+{
+  if (d->rec)
+    recorder_push(d->rec, event, event_time(event));
+  switch (event->type) {
+  // key events:
+  case XWII_EVENT_KEY:
+  case XWII_EVENT_CLASSIC_CONTROLLER_KEY:
+  case XWII_EVENT_PRO_CONTROLLER_KEY:
+  case XWII_EVENT_NUNCHUK_KEY:
+  case XWII_EVENT_DRUMS_KEY:
+  case XWII_EVENT_GUITAR_KEY:
+    return 1;
+  // hotplug events:
+  case XWII_EVENT_WATCH:
+    // the interfaces of replayed and mock devices are fixed
+    if (!d->be->live) break;
+    reopen_iface(d, "xwii_poll");
+    break;
+  // this is sent when the device was removed:
+  case XWII_EVENT_GONE:
+    if (!d->be->live) {
+      fprintf(stderr, "xwii_poll: %s '%s' finished\n", d->be->name, d->path);
+    } else {
+      fprintf(stderr, "xwii_poll: device #%d was removed\n", d->num);
+      pthread_mutex_lock(&registry.lock);
+      registry_remove(is_path, d->path);
+      pthread_mutex_unlock(&registry.lock);
+    }
+    dev_release(d);
+    return -1;
+  // motion events:
+  case XWII_EVENT_ACCEL:
+    if (d->cal.enabled)
+      calib_accel(&d->cal, &d->cal.awin, &d->cal.ascale, CAL_ACCEL,
+		  &event->v.abs[0]);
+    filter_sensor(d, SENSOR_ACCEL, event->v.abs, event);
+    d->accel = event->v.abs[0];
+    d->stamp[SENSOR_ACCEL] = event_time(event);
+    history_add(&d->hist[SENSOR_ACCEL], &d->accel,
+		d->stamp[SENSOR_ACCEL]);
+    if (d->fus.enabled)
+      fusion_accel(&d->fus, &d->accel, d->stamp[SENSOR_ACCEL],
+		   d->ifaces & XWII_IFACE_MOTION_PLUS);
+    sensor_hooks(d, SENSOR_ACCEL, &d->accel, d->stamp[SENSOR_ACCEL]);
+    break;
+  case XWII_EVENT_IR:
+    {
+      int i;
+      filter_sensor(d, SENSOR_IR, event->v.abs, event);
+      for (i = 0; i < 4; i++)
+	d->ir[i] = event->v.abs[i];
+      d->stamp[SENSOR_IR] = event_time(event);
+      if (d->ptr.enabled)
+	pointer_update(&d->ptr, d->ir, &d->accel, d->stamp[SENSOR_IR]);
+      break;
+    }
+  case XWII_EVENT_BALANCE_BOARD:
+    {
+      int i;
+      filter_sensor(d, SENSOR_BOARD, event->v.abs, event);
+      for (i = 0; i < 4; i++)
+	d->board[i] = event->v.abs[i];
+      d->stamp[SENSOR_BOARD] = event_time(event);
+      board_update(&d->bb, d->board);
+      break;
+    }
+  case XWII_EVENT_CLASSIC_CONTROLLER_MOVE:
+    if (d->classic_shape.enabled)
+      shape_sticks(&d->classic_shape, event->v.abs, 1);
+    filter_sensor(d, SENSOR_CLASSIC, event->v.abs, event);
+    d->classic[0] = event->v.abs[0];
+    d->classic[1] = event->v.abs[1];
+    d->classic[2] = event->v.abs[2];
+    d->stamp[SENSOR_CLASSIC] = event_time(event);
+    break;
+  case XWII_EVENT_PRO_CONTROLLER_MOVE:
+    if (d->pro_shape.enabled)
+      shape_sticks(&d->pro_shape, event->v.abs, 0);
+    filter_sensor(d, SENSOR_PRO, event->v.abs, event);
+    d->pro[0] = event->v.abs[0];
+    d->pro[1] = event->v.abs[1];
+    d->stamp[SENSOR_PRO] = event_time(event);
+    break;
+  case XWII_EVENT_MOTION_PLUS:
+    if (d->cal.enabled)
+      calib_gyro(&d->cal, &event->v.abs[0]);
+    filter_sensor(d, SENSOR_MOTION_PLUS, event->v.abs, event);
+    d->motion = event->v.abs[0];
+    d->stamp[SENSOR_MOTION_PLUS] = event_time(event);
+    history_add(&d->hist[SENSOR_MOTION_PLUS], &d->motion,
+		d->stamp[SENSOR_MOTION_PLUS]);
+    if (d->fus.enabled)
+      fusion_gyro(&d->fus, &d->motion, d->stamp[SENSOR_MOTION_PLUS]);
+    sensor_hooks(d, SENSOR_MOTION_PLUS, &d->motion,
+		 d->stamp[SENSOR_MOTION_PLUS]);
+    break;
+  case XWII_EVENT_NUNCHUK_MOVE:
+    if (d->cal.enabled) {
+      calib_accel(&d->cal, &d->cal.nwin, &d->cal.nascale, CAL_NUNCHUK_ACCEL,
+		  &event->v.abs[1]);
+      calib_stick(&d->cal, &event->v.abs[0]);
+    }
+    filter_sensor(d, SENSOR_NUNCHUK_STICK, &event->v.abs[0], event);
+    filter_sensor(d, SENSOR_NUNCHUK_ACCEL, &event->v.abs[1], event);
+    d->nunchuk_accel = event->v.abs[1];
+    d->nunchuk_stick = event->v.abs[0];
+    d->stamp[SENSOR_NUNCHUK_ACCEL] =
+      d->stamp[SENSOR_NUNCHUK_STICK] = event_time(event);
+    history_add(&d->hist[SENSOR_NUNCHUK_ACCEL],
+		&d->nunchuk_accel,
+		d->stamp[SENSOR_NUNCHUK_ACCEL]);
+    history_add(&d->hist[SENSOR_NUNCHUK_STICK],
+		&d->nunchuk_stick,
+		d->stamp[SENSOR_NUNCHUK_STICK]);
+    sensor_hooks(d, SENSOR_NUNCHUK_ACCEL, &d->nunchuk_accel,
+		 d->stamp[SENSOR_NUNCHUK_ACCEL]);
+    sensor_hooks(d, SENSOR_NUNCHUK_STICK, &d->nunchuk_stick,
+		 d->stamp[SENSOR_NUNCHUK_STICK]);
+    break;
+  case XWII_EVENT_GUITAR_MOVE:
+    d->guitar[0] = event->v.abs[0];
+    d->guitar[1] = event->v.abs[1];
+    d->guitar[2] = event->v.abs[2];
+    d->guitar_stamp = event_time(event);
+    break;
+  case XWII_EVENT_DRUMS_MOVE:
+    drums_update(d, event->v.abs, event_time(event));
+    break;
+  // ignore everything else
+  default:
+    //fprintf(stderr, "xwii_poll: unrecognized event #%d\n", event->type);
+    break;
+  }
+  return 0;
+}
+
+// Polls the device for key events and reports them. Returns nil if the device
+// isn't open, if there's an error reading from the device or if no key event
+// is currently available. Otherwise returns a single key event as a table
+// consisting of the key id, key status and the event's timestamp (monotonic
+// time in usecs, see below). This should be called in
+// regular intervals since it also records the current motion information
+// which can be queried using the corresponding functions below.
+
+// The optional second argument specifies a timeout in msecs. It defaults to
+// zero, so that the call never blocks and just returns nil if there's nothing
+// to read; this is what you want when polling from Pd's clock, as the Pd
+// scheduler must never wait for the device. A negative value waits until the
+// device reports something (which may take forever if the Wiimote just sits
+// on the table). Use xwii_wait below if you need to block for input.
+
+// If the reader thread is enabled (see xwii_reader above), the events are
+// taken from the device's event queue instead, which doesn't involve any
+// system calls unless we need to wait for input.
+
+// Besides the real key events, this also reports the synthetic key events
+// generated by the processing stages, such as recognized gestures. These
+// have codes beyond the range of the real keys, see xwii_codes below.
+
+// Common prologue of xwii_poll and xwii_poll_all: report any events dropped
+// by the reader thread and wait for input. Returns nonzero if there's
+// something to read.
+static int poll_input(devhandle *d, int timeout, const char *who)
+{
+  evring *r = d->ring;
+  int ret;
+  if (r) {
+    unsigned dropped = atomic_load_explicit(&r->dropped, memory_order_relaxed);
+    if (dropped != r->reported) {
+      fprintf(stderr, "%s: event queue overflow on device #%d, %u events dropped\n",
+	      who, d->num, dropped - r->reported);
+      r->reported = dropped;
+    }
+  }
+  ret = wait_input(d, timeout);
+  if (ret < 0 && errno != EINTR) {
+    ret = -errno;
+    fprintf(stderr, "%s: cannot poll fds err:%d\n", who, ret);
+  }
+  if (ret > 0) update_clock_offs();
+  return ret > 0;
+}
+
+static void push_key(lua_State *L, int code, int state, int64_t t)
+{
+  lua_createtable(L, 3, 0);
+  lua_pushinteger(L, code);
+  lua_rawseti(L, -2, 1);
+  lua_pushinteger(L, state);
+  lua_rawseti(L, -2, 2);
+  lua_pushinteger(L, t);
+  lua_rawseti(L, -2, 3);
+}
+
+static int l_xwii_poll(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  int timeout = (int)luaL_optinteger(L, 2, 0);
+  if (d->fds_num) {
+    struct xwii_event event;
+    synthevent sev;
+    int64_t now;
+    int ret;
+    latency_tick(&d->lat);
+    if (synth_pop(&d->synth, &sev)) {
+      // left over from the previous call
+      push_key(L, sev.code, sev.state, sev.time);
+      return 1;
+    }
+    if (!poll_input(d, timeout, "xwii_poll")) {
+      // nothing to read (timeout, interrupted or error)
+      lua_pushnil(L);
+      return 1;
+    }
+    now = d->lat.enabled ? monotonic_time() : 0;
+    while (1) {
+      ret = next_event(d, &event);
+      if (ret) {
+	if (ret != -EAGAIN) {
+	  fprintf(stderr, "xwii_poll: read failed err:%d\n", ret);
+	}
+	break;
+      }
+      if (now) latency_event(&d->lat, now, &event);
+      ret = handle_event(d, &event);
+      if (ret > 0) {
+	push_key(L, event.v.key.code, event.v.key.state, event_time(&event));
+	return 1;
+      } else if (ret < 0) {
+	lua_pushinteger(L, event.type);
+	return 1;
+      } else if (synth_pop(&d->synth, &sev)) {
+	push_key(L, sev.code, sev.state, sev.time);
+	return 1;
+      }
+    }
+  }
+  lua_pushnil(L);
+  return 1;
+}
+
+// Store the pending synthetic key events in the result table of
+// xwii_poll_all, starting at event number n. Returns the new event count.
+static int push_synth(lua_State *L, devhandle *d, int n)
+{
+  synthevent sev;
+  while (synth_pop(&d->synth, &sev)) {
+    lua_pushinteger(L, sev.code);
+    lua_rawseti(L, 3, 3*n+1);
+    lua_pushinteger(L, sev.state);
+    lua_rawseti(L, 3, 3*n+2);
+    lua_pushinteger(L, sev.time);
+    lua_rawseti(L, 3, 3*n+3);
+    n++;
+  }
+  return n;
+}
+
+// Like xwii_poll, but reads all pending events in one go and returns all key
+// events as a single flat table of code, state, timestamp triples (the
+// timestamp is in monotonic usecs), along with the number of key events. The
+// optional second argument is the timeout, as with xwii_poll. If a table is
+// given as the third argument, it is filled in place and returned, so that
+// no garbage is generated; note that entries beyond the 3*n values which have
+// been filled in are left untouched, so you'll have to use the returned count
+// to figure out how many events there are. If the device was removed, the
+// events up to that point are returned, along with the event type
+// XWII_EVENT_GONE as a third result. Returns nil if the device isn't open.
+static int l_xwii_poll_all(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  int timeout = (int)luaL_optinteger(L, 2, 0);
+  int n = 0, gone = 0;
+  if (!d->fds_num) {
+    lua_pushnil(L);
+    return 1;
+  }
+  if (lua_istable(L, 3)) {
+    lua_settop(L, 3);
+  } else {
+    lua_settop(L, 2);
+    lua_newtable(L);
+  }
+  latency_tick(&d->lat);
+  n = push_synth(L, d, n);
+  if (poll_input(d, timeout, "xwii_poll_all")) {
+    struct xwii_event event;
+    int64_t now = d->lat.enabled ? monotonic_time() : 0;
+    while (1) {
+      int ret = next_event(d, &event);
+      if (ret) {
+	if (ret != -EAGAIN) {
+	  fprintf(stderr, "xwii_poll_all: read failed err:%d\n", ret);
+	}
+	break;
+      }
+      if (now) latency_event(&d->lat, now, &event);
+      ret = handle_event(d, &event);
+      if (ret > 0) {
+	lua_pushinteger(L, event.v.key.code);
+	lua_rawseti(L, 3, 3*n+1);
+	lua_pushinteger(L, event.v.key.state);
+	lua_rawseti(L, 3, 3*n+2);
+	lua_pushinteger(L, event_time(&event));
+	lua_rawseti(L, 3, 3*n+3);
+	n++;
+      } else if (ret < 0) {
+	gone = 1;
+	break;
+      }
+      n = push_synth(L, d, n);
+    }
+  }
+  lua_pushinteger(L, n);
+  if (gone) {
+    lua_pushinteger(L, XWII_EVENT_GONE);
+    return 3;
+  }
+  return 2;
+}
+
+// Wait until the device has input available, for at most the given number of
+// msecs (the default of -1 waits indefinitely). Returns true if there's input
+// ready to be read with xwii_poll, false if the timeout expired, the call was
+// interrupted or the device isn't open. This doesn't consume any events.
+static int l_xwii_wait(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  int timeout = (int)luaL_optinteger(L, 2, -1);
+  if (d->fds_num) {
+    int ret = wait_input(d, timeout);
+    if (ret < 0 && errno != EINTR) {
+      fprintf(stderr, "xwii_wait: cannot poll fds err:%d\n", -errno);
+    }
+    lua_pushboolean(L, ret > 0);
+  } else {
+    lua_pushboolean(L, 0);
+  }
+  return 1;
+}
+
+// The following functions return the current movement data from the various
+// input devices as a single table. In most cases, the table contains the
+// corresponding x, y and z values (just x and y for IR and the Classic/Pro
+// Controller and Nunchuk sticks). The IR camera can track up to four IR
+// sources, so the resulting table contains four pairs of x, y values (eight
+// values in total). Likewise, two pairs of x, y data are returned for the
+// Classic/Pro Controller's two joystick positions (followed by the positions
+// of the two analog triggers for the Classic Controller, as another x, y
+// pair). For the balance board, the
+// table contains four weight values, one for each of the edges of the
+// board. Please note that all this data is updated by xwii_poll, so that
+// function must be called beforehand to get current values.
+
+// As a second result, all these functions return the kernel timestamp of the
+// data (monotonic time in usecs, 0 if no data has been received yet). This
+// can be compared with the current time as reported by xwii_time to
+// determine how old the data is; xwii_age below does that for you.
+
+// All these functions also take an optional table as second argument. If
+// present, the values are stored in that table, which is then returned
+// instead of a new table. Reusing the same table in each query avoids
+// creating garbage which has to be collected by Lua later.
+
+// Push the table to store the results in: the table given as argument arg
+// if any, a new table with room for n values otherwise.
+static void result_table(lua_State *L, int arg, int n)
+{
+  if (lua_istable(L, arg))
+    lua_pushvalue(L, arg);
+  else
+    lua_createtable(L, n, 0);
+}
+
+// Store an integer value at the given index of the table on top of the stack.
+static inline void set_int(lua_State *L, int i, lua_Integer val)
+{
+  lua_pushinteger(L, val);
+  lua_rawseti(L, -2, i);
+}
+
+static void push_xyz(lua_State *L, int arg, struct xwii_event_abs *abs)
+{
+  result_table(L, arg, 3);
+  set_int(L, 1, abs->x);
+  set_int(L, 2, abs->y);
+  set_int(L, 3, abs->z);
+}
+
+static void push_xy(lua_State *L, int arg, struct xwii_event_abs *abs)
+{
+  result_table(L, arg, 2);
+  set_int(L, 1, abs->x);
+  set_int(L, 2, abs->y);
+}
+
+// Core input devices (accelerometer and IR tracker)
+static int l_xwii_accel(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  if (d->fds_num &&
+      (d->ifaces & XWII_IFACE_CORE)) {
+    push_xyz(L, 2, &d->accel);
+    lua_pushinteger(L, d->stamp[SENSOR_ACCEL]);
+    return 2;
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+static int l_xwii_ir(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  if (d->fds_num &&
+      (d->ifaces & XWII_IFACE_CORE)) {
+    int i;
+    result_table(L, 2, 8);
+    for (i = 0; i < 4; i++) {
+      set_int(L, 2*i+1, d->ir[i].x);
+      set_int(L, 2*i+2, d->ir[i].y);
+    }
+    lua_pushinteger(L, d->stamp[SENSOR_IR]);
+    return 2;
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+// This requires Motion-Plus (built into the Wii Remote Plus, also available
+// as an extension).
+static int l_xwii_motion_plus(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  if (d->fds_num &&
+      (d->ifaces & XWII_IFACE_MOTION_PLUS)) {
+    push_xyz(L, 2, &d->motion);
+    lua_pushinteger(L, d->stamp[SENSOR_MOTION_PLUS]);
+    return 2;
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+// The following require the Nunchuk.
+static int l_xwii_nunchuk_accel(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  if (d->fds_num &&
+      (d->ifaces & XWII_IFACE_NUNCHUK)) {
+    push_xyz(L, 2, &d->nunchuk_accel);
+    lua_pushinteger(L, d->stamp[SENSOR_NUNCHUK_ACCEL]);
+    return 2;
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+static int l_xwii_nunchuk_stick(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  if (d->fds_num &&
+      (d->ifaces & XWII_IFACE_NUNCHUK)) {
+    push_xy(L, 2, &d->nunchuk_stick);
+    lua_pushinteger(L, d->stamp[SENSOR_NUNCHUK_STICK]);
+    return 2;
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+// This requires the Pro Controller. The values are the positions of the
+// left and right stick.
+static int l_xwii_pro_stick(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  if (d->fds_num &&
+      (d->ifaces & XWII_IFACE_PRO_CONTROLLER)) {
+    int i;
+    result_table(L, 2, 4);
+    for (i = 0; i < 2; i++) {
+      set_int(L, 2*i+1, d->pro[i].x);
+      set_int(L, 2*i+2, d->pro[i].y);
+    }
+    lua_pushinteger(L, d->stamp[SENSOR_PRO]);
+    return 2;
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+// This requires the Classic Controller. The values are the positions of the
+// left and right stick, followed by the positions of the left and right
+// analog trigger.
+static int l_xwii_classic(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  if (d->fds_num &&
+      (d->ifaces & XWII_IFACE_CLASSIC_CONTROLLER)) {
+    int i;
+    result_table(L, 2, 6);
+    for (i = 0; i < 3; i++) {
+      set_int(L, 2*i+1, d->classic[i].x);
+      set_int(L, 2*i+2, d->classic[i].y);
+    }
+    lua_pushinteger(L, d->stamp[SENSOR_CLASSIC]);
+    return 2;
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+// This requires the Balance Board. The values are the weights measured by
+// the four sensors of the board, top-right, bottom-right, top-left and
+// bottom-left, in units of 10 g (the kernel driver already applies the
+// board's factory calibration). See xwii_balance below for a more
+// convenient interface.
+static int l_xwii_board(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  if (d->fds_num &&
+      (d->ifaces & XWII_IFACE_BALANCE_BOARD)) {
+    int i;
+    result_table(L, 2, 4);
+    for (i = 0; i < 4; i++)
+      set_int(L, i+1, d->board[i].x);
+    lua_pushinteger(L, d->stamp[SENSOR_BOARD]);
+    return 2;
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+// This requires the guitar. The values are the stick position (x, y), the
+// whammy bar and the fret bar (touch strip) position.
+static int l_xwii_guitar(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  if (d->fds_num &&
+      (d->ifaces & XWII_IFACE_GUITAR)) {
+    result_table(L, 2, 4);
+    set_int(L, 1, d->guitar[0].x);
+    set_int(L, 2, d->guitar[0].y);
+    set_int(L, 3, d->guitar[1].x);
+    set_int(L, 4, d->guitar[2].x);
+    lua_pushinteger(L, d->guitar_stamp);
+    return 2;
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+// This requires the drums. The values are the stick position (x, y),
+// followed by the velocity (1-127, 0 if not hit yet) and the timestamp of
+// the last hit of each of the seven pads, in the order left cymbal, right
+// cymbal, left tom, right tom, far-right tom, bass pedal and hi-hat pedal
+// (i.e., 2+2*7 values in total). The hits are also reported as key events
+// by xwii_poll and xwii_poll_all as soon as they occur, with code
+// xwii_codes.drum + pad (the pad numbers are 1-7 in the order above) and
+// the velocity as the key state.
+static int l_xwii_drums(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  if (d->fds_num &&
+      (d->ifaces & XWII_IFACE_DRUMS)) {
+    int i;
+    result_table(L, 2, 2*XWII_DRUMS_ABS_NUM);
+    set_int(L, 1, d->drums[XWII_DRUMS_ABS_PAD].x);
+    set_int(L, 2, d->drums[XWII_DRUMS_ABS_PAD].y);
+    for (i = XWII_DRUMS_ABS_PAD+1; i < XWII_DRUMS_ABS_NUM; i++) {
+      set_int(L, 2*i+1, d->drum_vel[i]);
+      set_int(L, 2*i+2, d->drum_time[i]);
+    }
+    lua_pushinteger(L, d->drums_stamp);
+    return 2;
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+// Return the current time (monotonic time in usecs).
+static int l_xwii_time(lua_State *L)
+{
+  lua_pushinteger(L, monotonic_time());
+  return 1;
+}
+
+// Return the age of the current motion data in usecs, i.e., the time elapsed
+// since the kernel received the data. The optional second argument denotes
+// the kind of data (one of the sensor names "accel", "ir", "motionplus",
+// "ncaccel", "ncstick", "prostick", "board" and "classic"); if it is
+// omitted, the age of the most recent data of any kind is returned. Returns
+// nil if the device isn't open or no such data has been received yet.
+static int l_xwii_age(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  int sensor = lua_isnoneornil(L, 2) ? -1 :
+    luaL_checkoption(L, 2, NULL, sensor_names);
+  if (d->fds_num) {
+    int64_t stamp = 0;
+    if (sensor >= 0) {
+      stamp = d->stamp[sensor];
+    } else {
+      int i;
+      for (i = 0; i < NSENSORS; i++)
+	if (d->stamp[i] > stamp) stamp = d->stamp[i];
+    }
+    if (stamp > 0) {
+      lua_pushinteger(L, monotonic_time() - stamp);
+      return 1;
+    }
+  }
+  lua_pushnil(L);
+  return 1;
+}
+
+// Set the size of the motion history of the given sensor (one of "accel",
+// "motionplus", "ncaccel" and "ncstick"). The size is rounded up to the next
+// power of 2; a size of 0 (the default) disables the history. Without a
+// size argument, the current size is returned. Changing the size discards
+// all samples recorded so far. Returns the size of the history, or nil if
+// the device isn't open or we're out of memory.
+static int l_xwii_history_size(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  int sensor = luaL_checkoption(L, 2, NULL, sensor_names);
+  luaL_argcheck(L, has_history(sensor), 2, "no history for this sensor");
+  if (d->fds_num) {
+    history *h = &d->hist[sensor];
+    if (!lua_isnoneornil(L, 3)) {
+      lua_Integer size = luaL_checkinteger(L, 3);
+      luaL_argcheck(L, size >= 0 && size <= 0x1000000, 3, "invalid size");
+      if (history_resize(h, size) < 0) {
+	fprintf(stderr, "xwii_history_size: out of memory\n");
+	lua_pushnil(L);
+	return 1;
+      }
+    }
+    lua_pushinteger(L, h->size);
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+// Return all samples of the given sensor recorded since the given cursor
+// (the sample count returned by the previous invocation, 0 by default) as a
+// single flat table of x, y, z, timestamp quadruples, as well as the new
+// cursor, which can be passed in the next call. A third result indicates the
+// number of samples which were lost because they have been overwritten in
+// the meantime (make the history larger or query it more often if this
+// isn't zero). If a table is given as the fourth argument, it is filled in
+// place and returned; as with xwii_poll_all, entries beyond the values
+// filled in are left untouched, so you'll have to use the difference of the
+// cursors minus the lost samples to determine the number of samples. For the
+// Nunchuk's stick, the z values are always zero. Returns nil if the device
+// isn't open or the history of the sensor is disabled.
+static int l_xwii_history(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  int sensor = luaL_checkoption(L, 2, NULL, sensor_names);
+  lua_Integer since = luaL_optinteger(L, 3, 0);
+  history *h;
+  uint64_t pos, start, oldest, i;
+  int n = 0;
+  luaL_argcheck(L, has_history(sensor), 2, "no history for this sensor");
+  if (!d->fds_num ||
+      !d->hist[sensor].size) {
+    lua_pushnil(L);
+    return 1;
+  }
+  h = &d->hist[sensor];
+  // a negative cursor is invalid, as is one beyond the current count
+  pos = since < 0 ? h->count : (uint64_t)since;
+  if (pos > h->count) pos = h->count;
+  // oldest sample still available
+  oldest = h->count > h->size ? h->count - h->size : 0;
+  if (oldest < h->first) oldest = h->first;
+  start = pos < oldest ? oldest : pos;
+  if (lua_istable(L, 4)) {
+    lua_settop(L, 4);
+  } else {
+    lua_settop(L, 3);
+    lua_createtable(L, 4*(h->count - start), 0);
+  }
+  for (i = start; i < h->count; i++) {
+    unsigned k = i & (h->size-1);
+    lua_pushinteger(L, h->x[k]);
+    lua_rawseti(L, 4, ++n);
+    lua_pushinteger(L, h->y[k]);
+    lua_rawseti(L, 4, ++n);
+    lua_pushinteger(L, h->z[k]);
+    lua_rawseti(L, 4, ++n);
+    lua_pushinteger(L, h->t[k]);
+    lua_rawseti(L, 4, ++n);
+  }
+  lua_pushinteger(L, h->count);
+  lua_pushinteger(L, start - pos);
+  return 3;
+}
+
+// Return the current data of several sensors at once. The second argument is
+// a bitmask of the sensors to report; the bits are available in the
+// xwii_sensors table of this module, e.g., xwii_sensors.accel |
+// xwii_sensors.ir. The values of all requested sensors are returned in a
+// single flat table, in the order accel, ir, motionplus, ncaccel, ncstick,
+// prostick, board, classic (the order of the bits), each taking up the same
+// number of values as the corresponding query function. Thus the six values
+// of the Classic Controller (left stick x, y, right stick x, y, left and
+// right trigger, shaped as configured with xwii_sticks) always come last.
+// Sensors whose interface isn't available are reported as zeros; the bitmask
+// of the sensors which are actually available is returned as a second
+// result. An optional table to be filled in place may be given as the third
+// argument. Returns nil if the device isn't open.
+static int l_xwii_snapshot(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  unsigned mask = (unsigned)luaL_checkinteger(L, 2), avail = 0;
+  int i, j, n = 0;
+  if (!d->fds_num) {
+    lua_pushnil(L);
+    return 1;
+  }
+  for (i = 0; i < NSENSORS; i++)
+    if (mask & (1u<<i)) n += sensor_nvals[i];
+  result_table(L, 3, n);
+  n = 0;
+  for (i = 0; i < NSENSORS; i++) {
+    if (!(mask & (1u<<i))) continue;
+    if (!(d->ifaces & sensor_iface[i])) {
+      for (j = 0; j < sensor_nvals[i]; j++)
+	set_int(L, ++n, 0);
+      continue;
+    }
+    avail |= 1u<<i;
+    switch (i) {
+    case SENSOR_ACCEL:
+      set_int(L, ++n, d->accel.x);
+      set_int(L, ++n, d->accel.y);
+      set_int(L, ++n, d->accel.z);
+      break;
+    case SENSOR_IR:
+      for (j = 0; j < 4; j++) {
+	set_int(L, ++n, d->ir[j].x);
+	set_int(L, ++n, d->ir[j].y);
+      }
+      break;
+    case SENSOR_MOTION_PLUS:
+      set_int(L, ++n, d->motion.x);
+      set_int(L, ++n, d->motion.y);
+      set_int(L, ++n, d->motion.z);
+      break;
+    case SENSOR_NUNCHUK_ACCEL:
+      set_int(L, ++n, d->nunchuk_accel.x);
+      set_int(L, ++n, d->nunchuk_accel.y);
+      set_int(L, ++n, d->nunchuk_accel.z);
+      break;
+    case SENSOR_NUNCHUK_STICK:
+      set_int(L, ++n, d->nunchuk_stick.x);
+      set_int(L, ++n, d->nunchuk_stick.y);
+      break;
+    case SENSOR_PRO:
+      for (j = 0; j < 2; j++) {
+	set_int(L, ++n, d->pro[j].x);
+	set_int(L, ++n, d->pro[j].y);
+      }
+      break;
+    case SENSOR_BOARD:
+      for (j = 0; j < 4; j++)
+	set_int(L, ++n, d->board[j].x);
+      break;
+    case SENSOR_CLASSIC:
+      for (j = 0; j < 3; j++) {
+	set_int(L, ++n, d->classic[j].x);
+	set_int(L, ++n, d->classic[j].y);
+      }
+      break;
+    }
+  }
+  lua_pushinteger(L, avail);
+  return 2;
+}
+
+// Enable or configure sensor fusion. The second argument may be false to
+// disable fusion, or a table with any of the following options: beta (the
+// filter gain, 0.1 by default; larger values correct drift faster but make
+// the orientation more susceptible to linear acceleration), gyro_scale (the
+// scale factor of the Motion-Plus data in degrees/sec per unit; the default
+// is a nominal value which you may have to adjust for your device), and
+// reset (if true, reset the orientation to the identity). If the second
+// argument is omitted, fusion is enabled with the current (or default)
+// options. Returns true if fusion is enabled, nil if the device isn't open.
+static int l_xwii_fusion(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  fusion *f = &d->fus;
+  if (!d->fds_num) {
+    lua_pushnil(L);
+    return 1;
+  }
+  if (lua_isboolean(L, 2) && !lua_toboolean(L, 2)) {
+    f->enabled = 0;
+  } else {
+    if (!f->enabled) {
+      if (f->beta <= 0.0f) f->beta = 0.1f;
+      if (f->gyro_scale <= 0.0f) f->gyro_scale = GYRO_SCALE;
+      fusion_reset(f);
+      f->enabled = 1;
+    }
+    if (lua_istable(L, 2)) {
+      if (lua_getfield(L, 2, "beta") != LUA_TNIL)
+	f->beta = (float)luaL_checknumber(L, -1);
+      if (lua_getfield(L, 2, "gyro_scale") != LUA_TNIL)
+	f->gyro_scale = (float)luaL_checknumber(L, -1);
+      if (lua_getfield(L, 2, "reset") != LUA_TNIL && lua_toboolean(L, -1))
+	fusion_reset(f);
+      lua_pop(L, 3);
+    }
+  }
+  lua_pushboolean(L, f->enabled);
+  return 1;
+}
+
+// Return the orientation computed by sensor fusion (see above) as a table
+// with the quaternion w, x, y, z, followed by the Euler angles roll, pitch
+// and yaw in degrees, along with the timestamp of the most recent data. An
+// optional table to be filled in place may be given as the second argument.
+// Returns nil if the device isn't open or fusion isn't enabled.
+static int l_xwii_orientation(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  const float *q = d->fus.q;
+  float roll, pitch, yaw, sinp;
+  int i;
+  if (!d->fds_num || !d->fus.enabled) {
+    lua_pushnil(L);
+    return 1;
+  }
+  roll = atan2f(2.0f*(q[0]*q[1] + q[2]*q[3]),
+		1.0f - 2.0f*(q[1]*q[1] + q[2]*q[2]));
+  sinp = 2.0f*(q[0]*q[2] - q[3]*q[1]);
+  pitch = sinp >= 1.0f ? (float)M_PI/2 : sinp <= -1.0f ? -(float)M_PI/2 :
+    asinf(sinp);
+  yaw = atan2f(2.0f*(q[0]*q[3] + q[1]*q[2]),
+	       1.0f - 2.0f*(q[2]*q[2] + q[3]*q[3]));
+  result_table(L, 2, 7);
+  for (i = 0; i < 4; i++) {
+    lua_pushnumber(L, q[i]);
+    lua_rawseti(L, -2, i+1);
+  }
+  lua_pushnumber(L, roll*RAD2DEG);
+  lua_rawseti(L, -2, 5);
+  lua_pushnumber(L, pitch*RAD2DEG);
+  lua_rawseti(L, -2, 6);
+  lua_pushnumber(L, yaw*RAD2DEG);
+  lua_rawseti(L, -2, 7);
+  lua_pushinteger(L, d->fus.stamp);
+  return 2;
+}
+
+// Enable or configure calibration. The second argument may be false to
+// disable calibration, or a table with any of the following options: learn
+// (whether to learn the calibration parameters on the fly, true by default),
+// gyro_tol and accel_tol (the maximum deviation of the gyroscope and
+// accelerometer data at rest), and reset (if true, forget all parameters
+// learned or loaded so far). If the second argument is omitted, calibration
+// is enabled with the current (or default) options. Returns a flag
+// indicating whether calibration is enabled and a bitmask of the parameters
+// known so far (1 = gyroscope, 2 = accelerometer, 4 = Nunchuk accelerometer,
+// 8 = Nunchuk stick), or nil if the device isn't open.
+static int l_xwii_calibrate(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  calib *c = &d->cal;
+  if (!d->fds_num) {
+    lua_pushnil(L);
+    return 1;
+  }
+  if (lua_isboolean(L, 2) && !lua_toboolean(L, 2)) {
+    c->enabled = 0;
+  } else {
+    if (!c->enabled) {
+      if (!c->gyro_tol) {
+	c->learn = 1;
+	c->gyro_tol = 600;
+	c->accel_tol = 6;
+      }
+      c->enabled = 1;
+    }
+    if (lua_istable(L, 2)) {
+      if (lua_getfield(L, 2, "learn") != LUA_TNIL)
+	c->learn = lua_toboolean(L, -1);
+      if (lua_getfield(L, 2, "gyro_tol") != LUA_TNIL)
+	c->gyro_tol = luaL_checkinteger(L, -1);
+      if (lua_getfield(L, 2, "accel_tol") != LUA_TNIL)
+	c->accel_tol = luaL_checkinteger(L, -1);
+      if (lua_getfield(L, 2, "reset") != LUA_TNIL && lua_toboolean(L, -1))
+	calib_reset(c);
+      lua_pop(L, 4);
+    }
+  }
+  lua_pushboolean(L, c->enabled);
+  lua_pushinteger(L, c->valid);
+  return 2;
+}
+
+// Calibration profiles are kept in a text file with one line per device,
+// consisting of the device's serial number (or its path if the serial isn't
+// known) followed by the calibration parameters. Lines starting with '#' are
+// comments.
+
+#define CAL_FORMAT "%d %g %g %g %g %g %g %g %d %d %d %d"
+
+static const char *calib_key(devhandle *d)
+{
+  return d->serial ? d->serial : d->path;
+}
+
+// Save the calibration parameters of a device to the given file. An existing
+// entry for the device is replaced, other entries are kept. Returns true, or
+// nil in case of error.
+static int l_xwii_calib_save(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  const char *fname = luaL_checkstring(L, 2), *key;
+  calib *c = &d->cal;
+  stickcal *s = &c->stick;
+  char buf[1024], *tmp;
+  FILE *in, *out;
+  size_t n;
+  int ok;
+  if (!d->fds_num) {
+    lua_pushnil(L);
+    return 1;
+  }
+  key = calib_key(d);
+  n = strlen(key);
+  tmp = malloc(strlen(fname)+5);
+  if (!tmp) {
+    lua_pushnil(L);
+    return 1;
+  }
+  sprintf(tmp, "%s.tmp", fname);
+  if (!(out = fopen(tmp, "w"))) {
+    fprintf(stderr, "xwii_calib_save: %s: %s\n", tmp, strerror(errno));
+    free(tmp);
+    lua_pushnil(L);
+    return 1;
+  }
+  // copy the entries of other devices
+  if ((in = fopen(fname, "r"))) {
+    while (fgets(buf, sizeof(buf), in))
+      if (strncmp(buf, key, n) != 0 || (buf[n] != ' ' && buf[n] != '\t'))
+	fputs(buf, out);
+    fclose(in);
+  }
+  fprintf(out, "%s " CAL_FORMAT "\n", key, c->valid,
+	  c->gbias[0], c->gbias[1], c->gbias[2], c->ascale, c->nascale,
+	  s->c[0], s->c[1], s->lo[0], s->hi[0], s->lo[1], s->hi[1]);
+  ok = fclose(out) == 0;
+  if (ok && rename(tmp, fname) < 0) ok = 0;
+  if (!ok) {
+    fprintf(stderr, "xwii_calib_save: %s: %s\n", fname, strerror(errno));
+    unlink(tmp);
+  }
+  free(tmp);
+  if (ok)
+    lua_pushboolean(L, 1);
+  else
+    lua_pushnil(L);
+  return 1;
+}
+
+// Load the calibration parameters of a device from the given file and
+// enable calibration. Returns true if an entry for the device was found,
+// false if not, and nil in case of error.
+static int l_xwii_calib_load(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  const char *fname = luaL_checkstring(L, 2), *key;
+  calib *c = &d->cal;
+  char buf[1024];
+  FILE *fp;
+  size_t n;
+  int found = 0;
+  if (!d->fds_num) {
+    lua_pushnil(L);
+    return 1;
+  }
+  if (!(fp = fopen(fname, "r"))) {
+    fprintf(stderr, "xwii_calib_load: %s: %s\n", fname, strerror(errno));
+    lua_pushnil(L);
+    return 1;
+  }
+  key = calib_key(d);
+  n = strlen(key);
+  while (!found && fgets(buf, sizeof(buf), fp)) {
+    calib e;
+    stickcal *s = &e.stick;
+    if (buf[0] == '#' || strncmp(buf, key, n) != 0 ||
+	(buf[n] != ' ' && buf[n] != '\t'))
+      continue;
+    memset(&e, 0, sizeof(e));
+    if (sscanf(buf+n, CAL_FORMAT, &e.valid,
+	       &e.gbias[0], &e.gbias[1], &e.gbias[2], &e.ascale, &e.nascale,
+	       &s->c[0], &s->c[1], &s->lo[0], &s->hi[0],
+	       &s->lo[1], &s->hi[1]) == 12) {
+      calib_reset(c);
+      c->valid = e.valid;
+      memcpy(c->gbias, e.gbias, sizeof(e.gbias));
+      c->ascale = e.ascale;
+      c->nascale = e.nascale;
+      c->stick = *s;
+      found = 1;
+    } else {
+      fprintf(stderr, "xwii_calib_load: %s: bad entry for %s\n", fname, key);
+    }
+  }
+  fclose(fp);
+  if (found && !c->enabled) {
+    // enable with the default options
+    lua_settop(L, 1);
+    l_xwii_calibrate(L);
+  }
+  lua_pushboolean(L, found);
+  return 1;
+}
+
+// Configure the filter chain of a sensor. The third argument is a list of
+// filter stages which are applied in order, each given as a table with the
+// filter name followed by its parameters, e.g. {{"median", 5}, {"ema", 0.3}}.
+// Parameters which are omitted get their default values. The filters and
+// their parameters are:
+//
+// - {"ema", alpha}: exponential moving average with smoothing factor alpha,
+//   0 < alpha <= 1 (default 0.5; smaller values smooth more)
+// - {"lowpass", cutoff, q, rate}: biquad low-pass with the given cutoff
+//   frequency (10 Hz) and q (0.7071), for data arriving at the given rate
+//   (100 Hz, the nominal event rate of the Wiimote)
+// - {"oneeuro", mincutoff, beta, dcutoff}: One-Euro filter with the given
+//   minimum cutoff frequency (1 Hz), speed coefficient (0.007) and cutoff
+//   frequency of the derivative (1 Hz)
+// - {"median", n}: median of the last n samples (3, max. 9)
+//
+// If the third argument is omitted or empty, the filters of the sensor are
+// removed. Returns true, or nil if the device isn't open.
+static int l_xwii_filter(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  int sensor = luaL_checkoption(L, 2, NULL, sensor_names);
+  filterchain fc;
+  int i, j, n = 0;
+  memset(&fc, 0, sizeof(fc));
+  if (!lua_isnoneornil(L, 3)) {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    n = luaL_len(L, 3);
+    luaL_argcheck(L, n <= MAXSTAGES, 3, "too many filter stages");
+    for (i = 0; i < n; i++) {
+      const char *name, *err;
+      float p[3];
+      int type;
+      lua_rawgeti(L, 3, i+1);
+      luaL_argcheck(L, lua_istable(L, -1), 3, "filter stage must be a table");
+      lua_rawgeti(L, -1, 1);
+      name = lua_tostring(L, -1);
+      for (type = 0; filter_names[type]; type++)
+	if (name && strcmp(name, filter_names[type]) == 0) break;
+      if (!filter_names[type])
+	return luaL_argerror(L, 3, lua_pushfstring(L, "unknown filter '%s'",
+						   name ? name : "?"));
+      for (j = 0; j < 3; j++) {
+	lua_rawgeti(L, -2-j, j+2);
+	p[j] = lua_isnumber(L, -1) ? (float)lua_tonumber(L, -1) : NAN;
+      }
+      if ((err = filter_setup(&fc.st[i], type, p)))
+	return luaL_argerror(L, 3, err);
+      lua_pop(L, 5);
+    }
+    fc.nstages = n;
+  }
+  if (!d->fds_num) {
+    lua_pushnil(L);
+    return 1;
+  }
+  if (n == 0) {
+    free(d->filt[sensor]);
+    d->filt[sensor] = NULL;
+  } else {
+    if (!d->filt[sensor] &&
+	!(d->filt[sensor] = malloc(sizeof(filterchain)))) {
+      fprintf(stderr, "xwii_filter: cannot allocate filter chain\n");
+      lua_pushnil(L);
+      return 1;
+    }
+    *d->filt[sensor] = fc;
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+// Enable or configure IR pointer tracking. The second argument may be false
+// to disable tracking, or a table with any of the following options: accel
+// (if true, use the accelerometer to tell the sensor bar dots apart, so that
+// the Wiimote can be rolled all the way around; false by default), and bar
+// (the width of the sensor bar, 0.2 by default, which makes distances come
+// out in meters). If the second argument is omitted, tracking is enabled
+// with the current (or default) options. Returns true if tracking is
+// enabled, nil if the device isn't open.
+static int l_xwii_ir_tracking(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  irpointer *p = &d->ptr;
+  if (!d->fds_num) {
+    lua_pushnil(L);
+    return 1;
   }
-
-  xwii_monitor_unref(mon);
+  if (lua_isboolean(L, 2) && !lua_toboolean(L, 2)) {
+    p->enabled = 0;
+  } else {
+    if (!p->enabled) {
+      if (p->bar <= 0.0f) p->bar = 0.2f;
+      p->have_pair = p->ndots = 0;
+      p->enabled = 1;
+    }
+    if (lua_istable(L, 2)) {
+      if (lua_getfield(L, 2, "accel") != LUA_TNIL)
+	p->use_accel = lua_toboolean(L, -1);
+      if (lua_getfield(L, 2, "bar") != LUA_TNIL)
+	p->bar = (float)luaL_checknumber(L, -1);
+      lua_pop(L, 2);
+    }
+  }
+  lua_pushboolean(L, p->enabled);
   return 1;
 }
 
-// Return the name of a device, given by its index in the range 1..NDEV.
-// Return value is a string which must be freed by the caller.
-static char *get_dev(int num)
+// Return the IR pointer state as a table with the pointer position x, y
+// (normalized coordinates, 0..1 across the field of view of the camera, with
+// the origin in the top-left corner; values outside this range are possible
+// if one of the dots is off-screen), the distance to the sensor bar, the
+// roll angle in degrees (positive when rolled clockwise), and the number of
+// sensor bar dots seen (2; 1 if the position of the other dot was
+// estimated; 0 if the pointer is lost, in which case x, y and distance are
+// those of the last valid frame). Also returns the timestamp of the most
+// recent update. An optional table to be filled in place may be given as the
+// second argument. Returns nil if the device isn't open or tracking isn't
+// enabled (see above).
+static int l_xwii_pointer(lua_State *L)
 {
-  struct xwii_monitor *mon;
-  char *ent;
-  int i = 0;
+  devhandle *d = check_dev(L, 1);
+  irpointer *p = &d->ptr;
+  if (!d->fds_num || !p->enabled) {
+    lua_pushnil(L);
+    return 1;
+  }
+  result_table(L, 2, 5);
+  lua_pushnumber(L, p->x);
+  lua_rawseti(L, -2, 1);
+  lua_pushnumber(L, p->y);
+  lua_rawseti(L, -2, 2);
+  lua_pushnumber(L, p->dist);
+  lua_rawseti(L, -2, 3);
+  lua_pushnumber(L, p->roll);
+  lua_rawseti(L, -2, 4);
+  set_int(L, 5, p->ndots);
+  lua_pushinteger(L, p->stamp);
+  return 2;
+}
 
-  mon = xwii_monitor_new(false, false);
-  if (!mon) {
-    return NULL;
+// Enable or configure gesture recognition. The second argument may be false
+// to disable recognition, or a table with any of the following options:
+// source (the sensor which provides the data, "accel" by default; any of
+// the sensors with a history may be used, see xwii_history_size above),
+// threshold (the max. score of a match, 0.2 by default; the score is the
+// DTW distance divided by the magnitude of the template, so 0 is a perfect
+// match), and clear (if true, remove all templates). If the second argument
+// is omitted, recognition is enabled with the current (or default) options.
+// Recognized gestures are reported as key events by xwii_poll and
+// xwii_poll_all, with code xwii_codes.gesture + id and the score * 1000 as
+// the key state. Returns true if recognition is enabled, nil if the device
+// isn't open or we're out of memory.
+static int l_xwii_gestures(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  gestures *gs;
+  if (!d->fds_num) {
+    lua_pushnil(L);
+    return 1;
+  }
+  if (!d->gest && !(d->gest = gestures_new())) {
+    fprintf(stderr, "xwii_gestures: out of memory\n");
+    lua_pushnil(L);
+    return 1;
   }
-  while ((ent = xwii_monitor_poll(mon))) {
-    if (++i == num) break;
-    free(ent);
+  gs = d->gest;
+  if (lua_isboolean(L, 2) && !lua_toboolean(L, 2)) {
+    gs->enabled = 0;
+  } else {
+    gs->enabled = 1;
+    if (lua_istable(L, 2)) {
+      if (lua_getfield(L, 2, "source") != LUA_TNIL) {
+	int sensor = luaL_checkoption(L, -1, NULL, sensor_names);
+	luaL_argcheck(L, has_history(sensor), 2, "invalid source");
+	if (sensor != gs->source) {
+	  // start matching afresh with the new source
+	  int i;
+	  for (i = 0; i < gs->n; i++)
+	    gesture_restart(&gs->g[i]);
+	  gs->source = sensor;
+	  gs->cand = -1;
+	}
+      }
+      if (lua_getfield(L, 2, "threshold") != LUA_TNIL)
+	gs->threshold = (float)luaL_checknumber(L, -1);
+      if (lua_getfield(L, 2, "clear") != LUA_TNIL && lua_toboolean(L, -1)) {
+	while (gs->n > 0)
+	  gesture_remove(gs, gs->g[gs->n-1].id);
+      }
+      lua_pop(L, 3);
+    }
   }
-
-  xwii_monitor_unref(mon);
-
-  return ent;
+  lua_pushboolean(L, gs->enabled);
+  return 1;
 }
 
-// Open the device given its index in the range 1..NDEV. Returns the device
-// handle (the index) if the device can be opened, 0 otherwise. In the current
-// implementation, each device can only be opened once; if the device is
-// already open, 0 is returned instead, indicating failure.
-static int l_xwii_open(lua_State *L)
+// Add a gesture template with the given id (0-255), replacing any existing
+// template with the same id. The template is given as a flat table of x, y,
+// z triples; an optional stride (3 by default) may be given as the fourth
+// argument, so that, e.g., the data returned by xwii_history can be passed
+// with a stride of 4. The length of the table must be a positive multiple of
+// the stride. If the third argument is nil, the template is removed
+// instead. Returns true, or nil if the device isn't open or we're out of
+// memory.
+static int l_xwii_gesture_add(lua_State *L)
 {
-  int num = (int)luaL_checknumber(L, 1);
-  char *path = 0;
-  if (num < 1 || num > NDEV || !(path = get_dev(num))) {
-    fprintf(stderr, "xwii_open: cannot find device #%d\n", num);
-    lua_pushinteger(L, 0);
+  devhandle *d = check_dev(L, 1);
+  int id = (int)luaL_checkinteger(L, 2);
+  int stride = (int)luaL_optinteger(L, 4, 3);
+  float *data;
+  lua_Integer n;
+  int i, len, ret;
+  luaL_argcheck(L, id >= 0 && id < 256, 2, "invalid gesture id");
+  luaL_argcheck(L, stride >= 3, 4, "invalid stride");
+  if (!d->fds_num) {
+    lua_pushnil(L);
     return 1;
   }
-  if (devh[num-1].fds_num) { // device is already open
-    free(path);
-    lua_pushinteger(L, 0);
+  if (lua_isnoneornil(L, 3)) {
+    if (d->gest) gesture_remove(d->gest, id);
+    lua_pushboolean(L, 1);
     return 1;
   }
-  int ret = xwii_iface_new(&devh[num-1].iface, path);
-  if (ret) {
-    fprintf(stderr, "xwii_open: cannot create xwii_iface '%s' err:%d\n",
-	    path, ret);
-    free(path);
-    lua_pushinteger(L, 0);
+  luaL_checktype(L, 3, LUA_TTABLE);
+  n = luaL_len(L, 3);
+  if (n <= 0 || n % stride != 0)
+    return luaL_argerror(L, 3,
+			 "length must be a positive multiple of the stride");
+  luaL_argcheck(L, n/stride <= MAXGESTURELEN, 3, "template too long");
+  len = (int)(n/stride);
+  if (!d->gest && !(d->gest = gestures_new())) {
+    fprintf(stderr, "xwii_gesture_add: out of memory\n");
+    lua_pushnil(L);
     return 1;
   }
-  ret = xwii_iface_open(devh[num-1].iface,
-			xwii_iface_available(devh[num-1].iface) |
-			XWII_IFACE_WRITABLE);
-  if (ret) {
-    fprintf(stderr, "xwii_open: cannot open interface '%s' err: %d\n",
-	    path, ret);
-    xwii_iface_unref(devh[num-1].iface);
-    free(path);
-    lua_pushinteger(L, 0);
-    return 1;
+  data = lua_newuserdata(L, 3*len*sizeof(float));
+  for (i = 0; i < len; i++) {
+    int k;
+    for (k = 0; k < 3; k++) {
+      lua_rawgeti(L, 3, i*stride+k+1);
+      data[3*i+k] = (float)lua_tonumber(L, -1);
+      lua_pop(L, 1);
+    }
   }
-  ret = xwii_iface_watch(devh[num-1].iface, true);
-  if (ret) {
-    fprintf(stderr, "xwii_open: cannot initialize hotplug watch descriptor on interface '%s' err: %d\n",
-	    path, ret);
+  ret = gesture_add(d->gest, id, data, len, 3);
+  if (ret < 0) {
+    fprintf(stderr, "xwii_gesture_add: cannot add gesture #%d\n", id);
+    lua_pushnil(L);
+  } else {
+    lua_pushboolean(L, 1);
   }
-  memset(&devh[num-1].accel, 0, sizeof(devh[num-1].accel));
-  memset(&devh[num-1].motion, 0, sizeof(devh[num-1].motion));
-  memset(&devh[num-1].nunchuk_accel, 0, sizeof(devh[num-1].nunchuk_accel));
-  memset(&devh[num-1].nunchuk_stick, 0, sizeof(devh[num-1].nunchuk_stick));
-  memset(devh[num-1].fds, 0, sizeof(devh[num-1].fds));
-  devh[num-1].fds[0].fd = xwii_iface_get_fd(devh[num-1].iface);
-  devh[num-1].fds[0].events = POLLIN;
-  devh[num-1].fds_num = 1;
-  free(path);
-  lua_pushinteger(L, num);
   return 1;
 }
 
-// Close the device given by its handle. This never fails and doesn't return
-// anything.
-static int l_xwii_close(lua_State *L)
+// Record a gesture template. With an id as the second argument, this starts
+// recording the data of the recognizer's source (recognition is suspended
+// in the meantime). Without it, recording stops, and the recorded data is
+// installed as the template with the given id and returned as a flat table
+// of x, y, z triples, so that it can be saved and added again later with
+// xwii_gesture_add. Recording stops automatically after 512 samples. Returns
+// true when starting, and nil if the device isn't open, recognition isn't
+// enabled, nothing was recorded or we're out of memory.
+static int l_xwii_gesture_record(lua_State *L)
 {
-  int num = (int)luaL_checknumber(L, 1);
-  // check that device is open
-  if (num >= 1 && num <= NDEV && devh[num-1].fds_num) {
-    xwii_iface_close(devh[num-1].iface,
-		     xwii_iface_opened(devh[num-1].iface));
-    xwii_iface_unref(devh[num-1].iface);
-    devh[num-1].fds_num = 0;
+  devhandle *d = check_dev(L, 1);
+  gestures *gs = d->gest;
+  int i;
+  if (!d->fds_num || !gs || !gs->enabled) {
+    lua_pushnil(L);
+    return 1;
   }
-  return 0;
+  if (!lua_isnoneornil(L, 2)) {
+    int id = (int)luaL_checkinteger(L, 2);
+    luaL_argcheck(L, id >= 0 && id < 256, 2, "invalid gesture id");
+    if (!gs->rec && !(gs->rec = malloc(3*MAXGESTURELEN*sizeof(float)))) {
+      fprintf(stderr, "xwii_gesture_record: out of memory\n");
+      lua_pushnil(L);
+      return 1;
+    }
+    gs->rec_id = id;
+    gs->rec_len = 0;
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+  if (gs->rec_id < 0 || gs->rec_len == 0 ||
+      gesture_add(gs, gs->rec_id, gs->rec, gs->rec_len, 3) < 0) {
+    gs->rec_id = -1;
+    lua_pushnil(L);
+    return 1;
+  }
+  gs->rec_id = -1;
+  for (i = 0; i < gs->n; i++)
+    gesture_restart(&gs->g[i]);
+  lua_createtable(L, 3*gs->rec_len, 0);
+  for (i = 0; i < 3*gs->rec_len; i++) {
+    lua_pushnumber(L, gs->rec[i]);
+    lua_rawseti(L, -2, i+1);
+  }
+  return 1;
 }
 
-// Check which interfaces the device supports. This is a bitmask, see
-// xwii_iface_type in the xwiimote.h header file for possible values.
-static int l_xwii_info(lua_State *L)
+// Add a trigger with the given id (0-255), replacing any existing trigger
+// with the same id. The trigger is given as a table with the trigger type
+// (magnitude, zerocross, jerk or deadzone, see above) as its first element,
+// and the following fields: sensor (the sensor to watch, any of the sensors
+// with a history, "accel" by default; "ncstick" for deadzone), threshold
+// (the level at which the trigger fires, required), release (the level at
+// which the trigger is released again, the same as threshold by default;
+// choose a lower value to avoid repeated firing on noisy data), and axis
+// (the axis to watch with zerocross, 1-3 for x, y, z, 1 by default). If the
+// third argument is nil, the trigger is removed. Trigger events are
+// reported as key events by xwii_poll and xwii_poll_all, with code
+// xwii_codes.trigger + id. Returns true, or nil if the device isn't open or
+// there are too many triggers.
+static int l_xwii_trigger(lua_State *L)
 {
-  int num = (int)luaL_checknumber(L, 1);
-  if (num >= 1 && num <= NDEV && devh[num-1].fds_num) {
-    lua_pushinteger(L, xwii_iface_available(devh[num-1].iface));
+  devhandle *d = check_dev(L, 1);
+  int id = (int)luaL_checkinteger(L, 2);
+  trigger tr;
+  triggers *ts;
+  int i;
+  luaL_argcheck(L, id >= 0 && id < 256, 2, "invalid trigger id");
+  memset(&tr, 0, sizeof(tr));
+  tr.id = id;
+  if (!lua_isnoneornil(L, 3)) {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_rawgeti(L, 3, 1);
+    tr.type = luaL_checkoption(L, -1, NULL, trigger_names);
+    tr.sensor = tr.type == TRIG_DEADZONE ? SENSOR_NUNCHUK_STICK :
+      SENSOR_ACCEL;
+    if (lua_getfield(L, 3, "sensor") != LUA_TNIL) {
+      tr.sensor = luaL_checkoption(L, -1, NULL, sensor_names);
+      luaL_argcheck(L, has_history(tr.sensor), 3, "invalid sensor");
+    }
+    lua_getfield(L, 3, "threshold");
+    luaL_argcheck(L, lua_isnumber(L, -1), 3, "threshold required");
+    tr.threshold = tr.release = (float)lua_tonumber(L, -1);
+    if (lua_getfield(L, 3, "release") != LUA_TNIL)
+      tr.release = (float)luaL_checknumber(L, -1);
+    if (lua_getfield(L, 3, "axis") != LUA_TNIL) {
+      tr.axis = (int)luaL_checkinteger(L, -1) - 1;
+      luaL_argcheck(L, tr.axis >= 0 && tr.axis < 3, 3, "invalid axis");
+    }
+    lua_pop(L, 5);
+  }
+  if (!d->fds_num) {
+    lua_pushnil(L);
+    return 1;
+  }
+  if (!d->trig && !(d->trig = calloc(1, sizeof(triggers)))) {
+    fprintf(stderr, "xwii_trigger: out of memory\n");
+    lua_pushnil(L);
+    return 1;
+  }
+  ts = d->trig;
+  for (i = 0; i < ts->n && ts->t[i].id != id; i++) ;
+  if (lua_isnoneornil(L, 3)) {
+    if (i < ts->n) ts->t[i] = ts->t[--ts->n];
+  } else if (i == MAXTRIGGERS) {
+    fprintf(stderr, "xwii_trigger: too many triggers\n");
+    lua_pushnil(L);
+    return 1;
   } else {
-    lua_pushinteger(L, 0);
+    if (i == ts->n) ts->n++;
+    ts->t[i] = tr;
   }
+  lua_pushboolean(L, 1);
   return 1;
 }
 
-// Retrieve the battery capacity (unsigned 8 bit value).
-static int l_xwii_get_battery(lua_State *L)
+// Enable resampling of the given sensor (any of the sensors with a history)
+// at the given rate (Hz), using linear interpolation, or cubic
+// interpolation if the fourth argument is "cubic". A rate of 0 (or nil)
+// disables resampling. Returns true, or nil if the device isn't open or
+// we're out of memory.
+static int l_xwii_resample(lua_State *L)
 {
-  int num = (int)luaL_checknumber(L, 1);
-  if (num >= 1 && num <= NDEV && devh[num-1].fds_num) {
-    uint8_t capacity;
-    int ret = xwii_iface_get_battery(devh[num-1].iface, &capacity);
-    if (ret) {
-      fprintf(stderr, "xwii_get_battery: cannot read battery capacity\n");
+  static const char *const methods[] = { "linear", "cubic", NULL };
+  devhandle *d = check_dev(L, 1);
+  int sensor = luaL_checkoption(L, 2, NULL, sensor_names);
+  double rate = luaL_optnumber(L, 3, 0.0);
+  int cubic = luaL_checkoption(L, 4, "linear", methods);
+  luaL_argcheck(L, has_history(sensor), 2, "no resampling for this sensor");
+  luaL_argcheck(L, rate >= 0.0 && rate <= 10000.0, 3, "invalid rate");
+  if (!d->fds_num) {
+    lua_pushnil(L);
+    return 1;
+  }
+  if (rate == 0.0) {
+    free(d->rs[sensor]);
+    d->rs[sensor] = NULL;
+  } else {
+    resampler *rs = d->rs[sensor];
+    if (!rs && !(rs = d->rs[sensor] = malloc(sizeof(resampler)))) {
+      fprintf(stderr, "xwii_resample: out of memory\n");
       lua_pushnil(L);
-    } else {
-      lua_pushinteger(L, capacity);
+      return 1;
     }
-  } else {
-    lua_pushinteger(L, 0);
+    memset(rs, 0, offsetof(resampler, ft));
+    rs->rate = rate;
+    rs->cubic = cubic;
   }
+  lua_pushboolean(L, 1);
   return 1;
 }
 
-// Retrieve the status of the 4 LEDs as a bitmask.
-static int l_xwii_get_leds(lua_State *L)
+// Fetch the frames produced by the resampler of the given sensor since the
+// previous call, as a single flat table of x, y, z, timestamp quadruples
+// (the timestamps are spaced exactly 1/rate secs apart), along with the
+// number of frames and the number of frames which were lost because they
+// weren't fetched in time (the buffer holds 1024 frames). If a table is
+// given as the third argument, it is filled in place and returned; as with
+// xwii_poll_all, entries beyond the values filled in are left untouched.
+// Returns nil if the device isn't open or the sensor isn't being resampled.
+static int l_xwii_frames(lua_State *L)
 {
-  int num = (int)luaL_checknumber(L, 1);
-  if (num >= 1 && num <= NDEV && devh[num-1].fds_num) {
-    uint8_t mask = 0;
-    int i, ret = 0;
-    for (i = ret = 0; i < 4 && !ret; i++) {
-      bool flag;
-      ret = xwii_iface_get_led(devh[num-1].iface, XWII_LED(i+1), &flag);
-      if (!ret && flag) mask |= 1<<i;
-    }
-    if (ret) {
-      fprintf(stderr, "xwii_get_leds: cannot read LED state\n");
-      lua_pushnil(L);
-    } else {
-      lua_pushinteger(L, mask);
-    }
+  devhandle *d = check_dev(L, 1);
+  int sensor = luaL_checkoption(L, 2, NULL, sensor_names);
+  resampler *rs = d->rs[sensor];
+  int n = 0;
+  if (!d->fds_num || !rs) {
+    lua_pushnil(L);
+    return 1;
+  }
+  resample_hold(rs, monotonic_time());
+  if (lua_istable(L, 3)) {
+    lua_settop(L, 3);
   } else {
-    lua_pushinteger(L, 0);
+    lua_settop(L, 2);
+    lua_createtable(L, 4*(int)(rs->tail - rs->head), 0);
   }
-  return 1;
+  for (; rs->head != rs->tail; rs->head++, n++) {
+    unsigned i = rs->head & (RSFRAMES-1);
+    int j;
+    for (j = 0; j < 3; j++) {
+      lua_pushnumber(L, rs->fv[i][j]);
+      lua_rawseti(L, 3, 4*n+j+1);
+    }
+    lua_pushinteger(L, rs->ft[i]);
+    lua_rawseti(L, 3, 4*n+4);
+  }
+  lua_pushinteger(L, n);
+  lua_pushinteger(L, rs->lost);
+  rs->lost = 0;
+  return 3;
 }
 
-// Set the status of the 4 LEDs from a bitmask.
-static int l_xwii_set_leds(lua_State *L)
+// Configure the Balance Board processing. The second argument is a table
+// with any of the following options: tare (true starts taring, which takes
+// the average of the next 50 samples, i.e., about half a second, so the
+// board should be empty; false removes the tare), and smooth (the smoothing
+// factor, 0 < smooth <= 1, 0.3 by default; 1 disables smoothing). Returns
+// true, or nil if the device isn't open or isn't a Balance Board.
+static int l_xwii_balance_setup(lua_State *L)
 {
-  int num = (int)luaL_checknumber(L, 1);
-  uint8_t mask = (uint8_t)luaL_checknumber(L, 2);
-  if (num >= 1 && num <= NDEV && devh[num-1].fds_num) {
-    int i;
-    for (i = 0; i < 4; i++) {
-      bool flag = !!(mask & (1<<i));
-      int ret = xwii_iface_set_led(devh[num-1].iface, XWII_LED(i+1), flag);
-      if (ret) {
-	fprintf(stderr, "xwii_set_leds: cannot write LED state\n");
-	return 0;
-      }
+  devhandle *d = check_dev(L, 1);
+  board *b = &d->bb;
+  luaL_checktype(L, 2, LUA_TTABLE);
+  if (!d->fds_num || !(d->ifaces & XWII_IFACE_BALANCE_BOARD)) {
+    lua_pushnil(L);
+    return 1;
+  }
+  if (lua_getfield(L, 2, "tare") != LUA_TNIL) {
+    if (lua_toboolean(L, -1)) {
+      memset(b->tare_sum, 0, sizeof(b->tare_sum));
+      b->tare_n = TARE_SAMPLES;
+    } else {
+      memset(b->zero, 0, sizeof(b->zero));
+      b->tare_n = 0;
     }
   }
-  return 0;
+  if (lua_getfield(L, 2, "smooth") != LUA_TNIL) {
+    float a = (float)luaL_checknumber(L, -1);
+    luaL_argcheck(L, a > 0.0f && a <= 1.0f, 2, "invalid smoothing factor");
+    b->smooth = a;
+  }
+  lua_pop(L, 2);
+  lua_pushboolean(L, 1);
+  return 1;
 }
 
-// Set the status of the rumble motor (0 = off, nonzero = on).
-static int l_xwii_rumble(lua_State *L)
+// Return the processed Balance Board data as a table with the total weight
+// (kg), the centre of pressure x, y (mm from the centre of the board, x
+// pointing right, y pointing to the front; both 0 if the total weight is
+// less than 1 kg), and the weights at the four corners (kg; top-right,
+// bottom-right, top-left, bottom-left, like xwii_board), along with the
+// timestamp of the data. An optional table to be filled in place may be
+// given as the second argument. Returns nil if the device isn't open or
+// isn't a Balance Board.
+static int l_xwii_balance(lua_State *L)
 {
-  int num = (int)luaL_checknumber(L, 1);
-  int flag = (int)luaL_checknumber(L, 2);
-  if (num >= 1 && num <= NDEV && devh[num-1].fds_num) {
-    int ret = xwii_iface_rumble(devh[num-1].iface, !!flag);
-    if (ret) {
-      fprintf(stderr, "xwii_rumble: cannot set rumble motor state\n");
-    }
+  devhandle *d = check_dev(L, 1);
+  board *b = &d->bb;
+  int i;
+  if (!d->fds_num || !(d->ifaces & XWII_IFACE_BALANCE_BOARD)) {
+    lua_pushnil(L);
+    return 1;
   }
-  return 0;
+  result_table(L, 2, 7);
+  lua_pushnumber(L, b->total);
+  lua_rawseti(L, -2, 1);
+  lua_pushnumber(L, b->x);
+  lua_rawseti(L, -2, 2);
+  lua_pushnumber(L, b->y);
+  lua_rawseti(L, -2, 3);
+  for (i = 0; i < 4; i++) {
+    lua_pushnumber(L, b->w[i]);
+    lua_rawseti(L, -2, i+4);
+  }
+  lua_pushinteger(L, d->stamp[SENSOR_BOARD]);
+  return 2;
 }
 
-// Polls the device for key events and reports them. Returns nil if the device
-// isn't open, if there's an error reading from the device or if no key event
-// is currently available. Otherwise returns a single key event as a table
-// consisting of the event id, key id and key status. This should be called in
-// regular intervals since it also records the current motion information
-// which can be queried using the corresponding functions below.
-static int l_xwii_poll(lua_State *L)
+// Enable or configure stick shaping for the Classic Controller ("classic")
+// or the Pro Controller ("prostick"), given as the second argument. The
+// third argument may be false to disable shaping, or a table with any of
+// the following options: deadzone (the size of the dead zone as a fraction
+// of the stick range, 0.1 by default), and range (a list with the raw
+// ranges of the left and right stick and, for the Classic Controller, the
+// triggers; the defaults are 32, 16, 31 for the Classic and 1024, 1024 for
+// the Pro Controller). If the third argument is omitted, shaping is enabled
+// with the current (or default) options. Returns true if shaping is
+// enabled, nil if the device isn't open.
+static int l_xwii_sticks(lua_State *L)
 {
-  int num = (int)luaL_checknumber(L, 1);
-  if (num >= 1 && num <= NDEV && devh[num-1].fds_num) {
-    struct xwii_event event;
-    int ret = poll(devh[num-1].fds, devh[num-1].fds_num, -1);
-    if (ret < 0) {
-      if (errno != EINTR) {
-	ret = -errno;
-	fprintf(stderr, "xwii_poll: cannot poll fds err:%d\n", ret);
-      }
-      lua_pushnil(L);
-      return 1;
+  static const char *const names[] = { "classic", "prostick", NULL };
+  devhandle *d = check_dev(L, 1);
+  int pro = luaL_checkoption(L, 2, NULL, names);
+  stickshape *sh = pro ? &d->pro_shape : &d->classic_shape;
+  if (!d->fds_num) {
+    lua_pushnil(L);
+    return 1;
+  }
+  if (lua_isboolean(L, 3) && !lua_toboolean(L, 3)) {
+    sh->enabled = 0;
+  } else {
+    if (sh->deadzone <= 0.0f && sh->range[0] <= 0.0f) {
+      sh->deadzone = 0.1f;
+      memcpy(sh->range, pro ? pro_range : classic_range, sizeof(sh->range));
     }
-    while (1) {
-      ret = xwii_iface_dispatch(devh[num-1].iface, &event, sizeof(event));
-      if (ret) {
-	if (ret != -EAGAIN) {
-	  fprintf(stderr, "xwii_poll: read failed err:%d\n", ret);
-	}
-	break;
-      } else {
-	switch (event.type) {
-	// key events:
-	case XWII_EVENT_KEY:
-	case XWII_EVENT_CLASSIC_CONTROLLER_KEY:
-	case XWII_EVENT_PRO_CONTROLLER_KEY:
-	case XWII_EVENT_NUNCHUK_KEY:
-	case XWII_EVENT_DRUMS_KEY:
-	case XWII_EVENT_GUITAR_KEY:
-	  {
-	    int i = 0;
-	    lua_newtable(L);
-	    lua_pushinteger(L, ++i);
-	    lua_pushinteger(L, event.v.key.code);
-	    lua_settable(L, -3);
-	    lua_pushinteger(L, ++i);
-	    lua_pushinteger(L, event.v.key.state);
-	    lua_settable(L, -3);
-	    return 1;
-	  }
-	// hotplug events:
-	case XWII_EVENT_WATCH:
-	  {
-	    int ret = xwii_iface_open(devh[num-1].iface,
-				      xwii_iface_available(devh[num-1].iface));
-	    if (ret)
-	      fprintf(stderr, "xwii_poll: cannot open interface #%d err: %d\n",
-		      num, ret);
-	    else
-	      fprintf(stderr, "xwii_poll: hotplug event on interface #%d\n",
-		      num);
-	    break;
-	  }
-	// this is sent when the device was removed:
-	case XWII_EVENT_GONE:
-	  devh[num-1].fds[0].fd = -1;
-	  devh[num-1].fds[0].events = 0;
-	  devh[num-1].fds_num = 0;
-	  fprintf(stderr, "xwii_poll: device #%d was removed\n", num);
-	  lua_pushinteger(L, event.type);
-	  return 1;
-	// motion events:
-	case XWII_EVENT_ACCEL:
-	  devh[num-1].accel = event.v.abs[0];
-	  break;
-	case XWII_EVENT_IR:
-	  {
-	    int i;
-	    for (i = 0; i < 4; i++)
-	      devh[num-1].ir[i] = event.v.abs[i];
-	    break;
-	  }
-	case XWII_EVENT_BALANCE_BOARD:
-	  {
-	    int i;
-	    for (i = 0; i < 4; i++)
-	      devh[num-1].board[i] = event.v.abs[i];
-	    break;
+    sh->enabled = 1;
+    if (lua_istable(L, 3)) {
+      if (lua_getfield(L, 3, "deadzone") != LUA_TNIL) {
+	float dz = (float)luaL_checknumber(L, -1);
+	luaL_argcheck(L, dz >= 0.0f && dz < 1.0f, 3, "invalid dead zone");
+	sh->deadzone = dz;
+      }
+      if (lua_getfield(L, 3, "range") != LUA_TNIL) {
+	int i;
+	luaL_checktype(L, -1, LUA_TTABLE);
+	for (i = 0; i < (pro ? 2 : 3); i++) {
+	  lua_rawgeti(L, -1, i+1);
+	  if (lua_isnumber(L, -1)) {
+	    float r = (float)lua_tonumber(L, -1);
+	    luaL_argcheck(L, r > 0.0f, 3, "invalid range");
+	    sh->range[i] = r;
 	  }
-	case XWII_EVENT_CLASSIC_CONTROLLER_MOVE:
-	case XWII_EVENT_PRO_CONTROLLER_MOVE:
-	  // XXFIXME: We store the joystick positions of both the classic and
-	  // pro controllers in the same field for now. Maybe these should be
-	  // split up?
-	  devh[num-1].pro[0] = event.v.abs[0];
-	  devh[num-1].pro[1] = event.v.abs[1];
-	  break;
-	case XWII_EVENT_MOTION_PLUS:
-	  devh[num-1].motion = event.v.abs[0];
-	  break;
-	case XWII_EVENT_NUNCHUK_MOVE:
-	  devh[num-1].nunchuk_accel = event.v.abs[1];
-	  devh[num-1].nunchuk_stick = event.v.abs[0];
-	  break;
-	// ignore everything else; XXXTODO: guitar and drum movements
-	default:
-	  //fprintf(stderr, "xwii_poll: unrecognized event #%d\n", event.type);
-	  break;
+	  lua_pop(L, 1);
 	}
       }
+      lua_pop(L, 2);
     }
   }
-  lua_pushnil(L);
+  lua_pushboolean(L, sh->enabled);
   return 1;
 }
 
-// The following functions return the current movement data from the various
-// input devices as a single table. In most cases, the table contains the
-// corresponding x, y and z values (just x and y for IR and the Classic/Pro
-// Controller and Nunchuk sticks). The IR camera can track up to four IR
-// sources, so the resulting table contains four pairs of x, y values (eight
-// values in total). Likewise, two pairs of x, y data are returned for the
-// Classic/Pro Controller's two joystick positions. For the balance board, the
-// table contains four weight values, one for each of the edges of the
-// board. Please note that all this data is updated by xwii_poll, so that
-// function must be called beforehand to get current values.
-
-static void push_xyz(lua_State *L, struct xwii_event_abs *abs)
-{
-  int i = 0;
-  lua_newtable(L);
-  lua_pushinteger(L, ++i);
-  lua_pushinteger(L, abs->x);
-  lua_settable(L, -3);
-  lua_pushinteger(L, ++i);
-  lua_pushinteger(L, abs->y);
-  lua_settable(L, -3);
-  lua_pushinteger(L, ++i);
-  lua_pushinteger(L, abs->z);
-  lua_settable(L, -3);
-}
-
-static void push_xy(lua_State *L, struct xwii_event_abs *abs)
-{
-  int i = 0;
-  lua_newtable(L);
-  lua_pushinteger(L, ++i);
-  lua_pushinteger(L, abs->x);
-  lua_settable(L, -3);
-  lua_pushinteger(L, ++i);
-  lua_pushinteger(L, abs->y);
-  lua_settable(L, -3);
-}
-
-// Core input devices (accelerometer and IR tracker)
-static int l_xwii_accel(lua_State *L)
+// Start recording the events of the device to the given file (see the
+// description of the log format above), stopping any recording in progress.
+// If the second argument is omitted or false, just stop recording. Returns
+// true when starting; when stopping, returns the number of events recorded
+// and the number of events dropped. Returns nil if the device isn't open,
+// if there's an error, or if there's no recording to stop.
+static int l_xwii_record(lua_State *L)
 {
-  int num = (int)luaL_checknumber(L, 1);
-  if (num >= 1 && num <= NDEV && devh[num-1].fds_num &&
-      (xwii_iface_opened(devh[num-1].iface) & XWII_IFACE_CORE)) {
-    push_xyz(L, &devh[num-1].accel);
-  } else {
+  devhandle *d = check_dev(L, 1);
+  const char *fname = lua_toboolean(L, 2) ? luaL_checkstring(L, 2) : NULL;
+  if (!d->fds_num) {
     lua_pushnil(L);
+    return 1;
   }
-  return 1;
-}
-
-static int l_xwii_ir(lua_State *L)
-{
-  int num = (int)luaL_checknumber(L, 1);
-  if (num >= 1 && num <= NDEV && devh[num-1].fds_num &&
-      (xwii_iface_opened(devh[num-1].iface) & XWII_IFACE_CORE)) {
-    int i;
-    lua_newtable(L);
-    for (i = 0; i < 4; i++) {
-      lua_pushinteger(L, 2*i+1);
-      lua_pushinteger(L, devh[num-1].ir[i].x);
-      lua_settable(L, -3);
-      lua_pushinteger(L, 2*i+2);
-      lua_pushinteger(L, devh[num-1].ir[i].y);
-      lua_settable(L, -3);
+  if (d->rec) {
+    recorder *rc = d->rec;
+    int err = recorder_stop(rc);
+    d->rec = NULL;
+    if (err) {
+      fprintf(stderr, "xwii_record: write error err:%d\n", -err);
+      free(rc);
+      lua_pushnil(L);
+      return 1;
     }
-  } else {
+    if (!fname) {
+      lua_pushinteger(L, rc->written);
+      lua_pushinteger(L, rc->dropped);
+      free(rc);
+      return 2;
+    }
+    free(rc);
+  }
+  if (!fname) {
     lua_pushnil(L);
+    return 1;
+  }
+  if (!(d->rec = recorder_start(fname, d->serial ? d->serial : d->path))) {
+    fprintf(stderr, "xwii_record: %s: %s\n", fname, strerror(errno));
+    lua_pushnil(L);
+    return 1;
   }
+  lua_pushboolean(L, 1);
   return 1;
 }
 
-// This requires Motion-Plus (built into the Wii Remote Plus, also available
-// as an extension).
-static int l_xwii_motion_plus(lua_State *L)
+// Open a session log written by xwii_record in place of a live device. The
+// optional second argument, if true, replays the events in real time,
+// according to their recorded timestamps; otherwise they are delivered as
+// fast as xwii_poll or xwii_poll_all can consume them (the timestamps still
+// reflect the recorded timing, so they run ahead of the clock in this
+// case). Returns a device handle which can be used with all the functions
+// operating on devices, along with the number of events in the log and the
+// duration of the recorded session in usecs, or nil if the log can't be
+// opened. The interfaces reported by xwii_info are those used in the log.
+// When the end of the log is reached, the device reports the GONE event and
+// is closed, just like a live device which has been removed. Replayed
+// devices are always read directly, even if the reader thread is running.
+static int l_xwii_replay(lua_State *L)
 {
-  int num = (int)luaL_checknumber(L, 1);
-  if (num >= 1 && num <= NDEV && devh[num-1].fds_num &&
-      (xwii_iface_opened(devh[num-1].iface) & XWII_IFACE_MOTION_PLUS)) {
-    push_xyz(L, &devh[num-1].motion);
-  } else {
+  const char *fname = luaL_checkstring(L, 1);
+  replayopts o = { fname, lua_toboolean(L, 2) };
+  devhandle *d = dev_new(L);
+  replay *rp;
+  char *path, *serial;
+  if (!(path = strdup(fname))) {
+    fprintf(stderr, "xwii_replay: out of memory\n");
     lua_pushnil(L);
+    return 1;
   }
-  return 1;
+  if (!(rp = replay_backend.open(&o, 0))) {
+    if (errno == EINVAL)
+      fprintf(stderr, "xwii_replay: %s: not a session log\n", fname);
+    else
+      fprintf(stderr, "xwii_replay: %s: %s\n", fname, strerror(errno));
+    free(path);
+    lua_pushnil(L);
+    return 1;
+  }
+  serial = strdup(rp->key);
+  dev_attach(d, &replay_backend, rp, 0, path, serial);
+  lua_pushinteger(L, rp->nevents);
+  lua_pushinteger(L, rp->duration);
+  return 3;
 }
 
-// The following require the Nunchuk.
-static int l_xwii_nunchuk_accel(lua_State *L)
+// Create a mock device which generates synthetic events, for testing
+// without a Wiimote. The argument is a table with the following optional
+// fields: the rates (events per second) of the different kinds of events,
+// keys, accel, motionplus, ir, nunchuk and board (by default, only
+// accelerometer data is generated, at 100 Hz, which is what a real Wiimote
+// does); motion, either "sine" (the default) or "noise"; amplitude (default
+// 100) and frequency (default 1 Hz) of the motion; seed, the seed of the
+// random generator (default 1); count, the number of events after which the
+// device reports itself as removed (default 0, unlimited); and realtime,
+// which defaults to true, false generates the events as fast as they are
+// consumed. The key events press and release the Wiimote buttons in
+// turn. The rates must not be negative, and at least one of them must be
+// nonzero. Returns the device handle, which works with all the functions
+// operating on devices.
+static int l_xwii_mock(lua_State *L)
 {
-  int num = (int)luaL_checknumber(L, 1);
-  if (num >= 1 && num <= NDEV && devh[num-1].fds_num &&
-      (xwii_iface_opened(devh[num-1].iface) & XWII_IFACE_NUNCHUK)) {
-    push_xyz(L, &devh[num-1].nunchuk_accel);
-  } else {
+  mockopts o;
+  devhandle *d;
+  mock *m;
+  char *path;
+  int i, enabled = 0;
+  memset(&o, 0, sizeof(o));
+  o.rate[MOCK_ACCEL] = 100.0;
+  o.amp = 100.0;
+  o.freq = 1.0;
+  o.seed = 1;
+  o.realtime = 1;
+  if (lua_istable(L, 1)) {
+    for (i = 0; i < NMOCK; i++) {
+      if (lua_getfield(L, 1, mock_names[i]) != LUA_TNIL) {
+	o.rate[i] = luaL_checknumber(L, -1);
+	if (!(o.rate[i] >= 0.0))
+	  return luaL_argerror(L, 1, lua_pushfstring(L, "invalid %s rate",
+						     mock_names[i]));
+      }
+      lua_pop(L, 1);
+    }
+    if (lua_getfield(L, 1, "motion") != LUA_TNIL)
+      o.noise = strcmp(luaL_checkstring(L, -1), "noise") == 0;
+    if (lua_getfield(L, 1, "amplitude") != LUA_TNIL)
+      o.amp = luaL_checknumber(L, -1);
+    if (lua_getfield(L, 1, "frequency") != LUA_TNIL)
+      o.freq = luaL_checknumber(L, -1);
+    if (lua_getfield(L, 1, "seed") != LUA_TNIL)
+      o.seed = (uint32_t)luaL_checkinteger(L, -1);
+    if (lua_getfield(L, 1, "count") != LUA_TNIL)
+      o.count = luaL_checkinteger(L, -1);
+    if (lua_getfield(L, 1, "realtime") != LUA_TNIL)
+      o.realtime = lua_toboolean(L, -1);
+    lua_pop(L, 6);
+  }
+  // without any events, the device would just spin in fast mode
+  for (i = 0; i < NMOCK; i++)
+    if (o.rate[i] > 0.0) enabled = 1;
+  luaL_argcheck(L, enabled, 1, "no events enabled");
+  d = dev_new(L);
+  if (!(path = strdup("mock"))) {
+    fprintf(stderr, "xwii_mock: out of memory\n");
     lua_pushnil(L);
+    return 1;
+  }
+  if (!(m = mock_backend.open(&o, 0))) {
+    fprintf(stderr, "xwii_mock: %s\n", strerror(errno));
+    free(path);
+    lua_pushnil(L);
+    return 1;
   }
+  dev_attach(d, &mock_backend, m, 0, path, NULL);
   return 1;
 }
 
-static int l_xwii_nunchuk_stick(lua_State *L)
+// Enable (true or no argument) or disable (false) latency measurements on a
+// device, see the description of the latency histograms above. Enabling
+// clears the histograms. Returns true if the measurements are enabled, nil
+// if the device isn't open.
+static int l_xwii_latency(lua_State *L)
 {
-  int num = (int)luaL_checknumber(L, 1);
-  if (num >= 1 && num <= NDEV && devh[num-1].fds_num &&
-      (xwii_iface_opened(devh[num-1].iface) & XWII_IFACE_NUNCHUK)) {
-    push_xy(L, &devh[num-1].nunchuk_stick);
-  } else {
+  devhandle *d = check_dev(L, 1);
+  if (!d->fds_num) {
     lua_pushnil(L);
+    return 1;
   }
+  if (lua_isboolean(L, 2) && !lua_toboolean(L, 2)) {
+    d->lat.enabled = 0;
+  } else {
+    latency_reset(&d->lat);
+    d->lat.enabled = 1;
+  }
+  lua_pushboolean(L, d->lat.enabled);
   return 1;
 }
 
-// This requires the Classic/Pro Controller.
-static int l_xwii_pro_stick(lua_State *L)
+static const char *const latency_names[] = { "event", "tick", NULL };
+
+static inline lathist *latency_hist(devhandle *d, int which)
 {
-  int num = (int)luaL_checknumber(L, 1);
-  if (num >= 1 && num <= NDEV && devh[num-1].fds_num &&
-      (xwii_iface_opened(devh[num-1].iface) & XWII_IFACE_CORE)) {
-    int i;
-    lua_newtable(L);
-    for (i = 0; i < 2; i++) {
-      lua_pushinteger(L, 2*i+1);
-      lua_pushinteger(L, devh[num-1].pro[i].x);
-      lua_settable(L, -3);
-      lua_pushinteger(L, 2*i+2);
-      lua_pushinteger(L, devh[num-1].pro[i].y);
-      lua_settable(L, -3);
-    }
-  } else {
+  return which ? &d->lat.tick : &d->lat.event;
+}
+
+// Return a summary of one of the latency histograms, "event" (kernel
+// timestamp to delivery, the default) or "tick" (delivery to the next
+// poll), as a table with the fields n (number of measurements), mean, p50,
+// p90, p99 and max (usecs), and ahead (number of events with a timestamp
+// in the future, which aren't included in the other fields). The
+// percentiles are the upper bounds of the histogram buckets they fall into. An optional table to be filled in place
+// may be given as the third argument. Returns nil if the device isn't open.
+static int l_xwii_latency_stats(lua_State *L)
+{
+  devhandle *d = check_dev(L, 1);
+  lathist *h = latency_hist(d, luaL_checkoption(L, 2, "event",
+						latency_names));
+  uint64_t n;
+  if (!d->fds_num) {
     lua_pushnil(L);
+    return 1;
   }
+  n = atomic_load_explicit(&h->n, memory_order_relaxed);
+  if (lua_istable(L, 3))
+    lua_pushvalue(L, 3);
+  else
+    lua_createtable(L, 0, 7);
+  lua_pushinteger(L, n);
+  lua_setfield(L, -2, "n");
+  lua_pushnumber(L, n ? (double)atomic_load_explicit(&h->sum,
+						   memory_order_relaxed)/n : 0);
+  lua_setfield(L, -2, "mean");
+  lua_pushinteger(L, lathist_quantile(h, 0.5));
+  lua_setfield(L, -2, "p50");
+  lua_pushinteger(L, lathist_quantile(h, 0.9));
+  lua_setfield(L, -2, "p90");
+  lua_pushinteger(L, lathist_quantile(h, 0.99));
+  lua_setfield(L, -2, "p99");
+  lua_pushinteger(L, atomic_load_explicit(&h->max, memory_order_relaxed));
+  lua_setfield(L, -2, "max");
+  lua_pushinteger(L, atomic_load_explicit(&h->ahead, memory_order_relaxed));
+  lua_setfield(L, -2, "ahead");
   return 1;
 }
 
-// This requires the Balance Board.
-static int l_xwii_board(lua_State *L)
+// Return both latency histograms as text, one line for each non-empty
+// bucket with its range (usecs), count and a bar, preceded by a summary.
+// Returns nil if the device isn't open.
+static int l_xwii_latency_dump(lua_State *L)
 {
-  int num = (int)luaL_checknumber(L, 1);
-  if (num >= 1 && num <= NDEV && devh[num-1].fds_num &&
-      (xwii_iface_opened(devh[num-1].iface) & XWII_IFACE_CORE)) {
-    int i;
-    lua_newtable(L);
-    for (i = 0; i < 4; i++) {
-      lua_pushinteger(L, i+1);
-      lua_pushinteger(L, devh[num-1].board[i].x);
-      lua_settable(L, -3);
-    }
-  } else {
+  devhandle *d = check_dev(L, 1);
+  luaL_Buffer b;
+  char buf[256];
+  int k, i;
+  if (!d->fds_num) {
     lua_pushnil(L);
+    return 1;
   }
+  luaL_buffinit(L, &b);
+  for (k = 0; latency_names[k]; k++) {
+    lathist *h = latency_hist(d, k);
+    uint64_t n = atomic_load_explicit(&h->n, memory_order_relaxed), top = 0;
+    uint64_t count[LAT_BUCKETS];
+    for (i = 0; i < LAT_BUCKETS; i++) {
+      count[i] = atomic_load_explicit(&h->count[i], memory_order_relaxed);
+      if (count[i] > top) top = count[i];
+    }
+    snprintf(buf, sizeof(buf), "%s latency (usecs): n %llu mean %.1f "
+	     "p50 %llu p90 %llu p99 %llu max %llu ahead %llu\n",
+	     latency_names[k],
+	     (unsigned long long)n,
+	     n ? (double)atomic_load_explicit(&h->sum,
+					     memory_order_relaxed)/n : 0.0,
+	     (unsigned long long)lathist_quantile(h, 0.5),
+	     (unsigned long long)lathist_quantile(h, 0.9),
+	     (unsigned long long)lathist_quantile(h, 0.99),
+	     (unsigned long long)atomic_load_explicit(&h->max,
+						      memory_order_relaxed),
+	     (unsigned long long)atomic_load_explicit(&h->ahead,
+						      memory_order_relaxed));
+    luaL_addstring(&b, buf);
+    for (i = 0; i < LAT_BUCKETS; i++) {
+      int len;
+      if (!count[i]) continue;
+      len = snprintf(buf, sizeof(buf), "%10llu-%-10llu %10llu ",
+		     (unsigned long long)lat_lo(i),
+		     (unsigned long long)lat_hi(i),
+		     (unsigned long long)count[i]);
+      len += snprintf(buf+len, sizeof(buf)-len, "%.*s\n",
+		      (int)((count[i]*40+top-1)/top),
+		      "########################################");
+      luaL_addlstring(&b, buf, len);
+    }
+  }
+  luaL_pushresult(&b);
   return 1;
 }
 
 static const struct luaL_Reg xwiilua [] = {
   {"xwii_list", l_xwii_list},
+  {"xwii_reader", l_xwii_reader},
   {"xwii_open", l_xwii_open},
+  {"xwii_open_path", l_xwii_open_path},
+  {"xwii_replay", l_xwii_replay},
+  {"xwii_mock", l_xwii_mock},
+  {"xwii_path", l_xwii_path},
+  {"xwii_hotplug", l_xwii_hotplug},
   {"xwii_close", l_xwii_close},
   {"xwii_info", l_xwii_info},
   {"xwii_get_battery", l_xwii_get_battery},
@@ -543,17 +5367,142 @@ static const struct luaL_Reg xwiilua [] = {
   {"xwii_set_leds", l_xwii_set_leds},
   {"xwii_rumble", l_xwii_rumble},
   {"xwii_poll", l_xwii_poll},
+  {"xwii_poll_all", l_xwii_poll_all},
+  {"xwii_wait", l_xwii_wait},
   {"xwii_accel", l_xwii_accel},
   {"xwii_ir", l_xwii_ir},
   {"xwii_motion_plus", l_xwii_motion_plus},
   {"xwii_nunchuk_accel", l_xwii_nunchuk_accel},
   {"xwii_nunchuk_stick", l_xwii_nunchuk_stick},
   {"xwii_pro_stick", l_xwii_pro_stick},
+  {"xwii_classic", l_xwii_classic},
   {"xwii_board", l_xwii_board},
+  {"xwii_guitar", l_xwii_guitar},
+  {"xwii_drums", l_xwii_drums},
+  {"xwii_time", l_xwii_time},
+  {"xwii_age", l_xwii_age},
+  {"xwii_history_size", l_xwii_history_size},
+  {"xwii_history", l_xwii_history},
+  {"xwii_snapshot", l_xwii_snapshot},
+  {"xwii_fusion", l_xwii_fusion},
+  {"xwii_orientation", l_xwii_orientation},
+  {"xwii_calibrate", l_xwii_calibrate},
+  {"xwii_calib_save", l_xwii_calib_save},
+  {"xwii_calib_load", l_xwii_calib_load},
+  {"xwii_filter", l_xwii_filter},
+  {"xwii_ir_tracking", l_xwii_ir_tracking},
+  {"xwii_pointer", l_xwii_pointer},
+  {"xwii_gestures", l_xwii_gestures},
+  {"xwii_gesture_add", l_xwii_gesture_add},
+  {"xwii_gesture_record", l_xwii_gesture_record},
+  {"xwii_trigger", l_xwii_trigger},
+  {"xwii_resample", l_xwii_resample},
+  {"xwii_frames", l_xwii_frames},
+  {"xwii_balance_setup", l_xwii_balance_setup},
+  {"xwii_balance", l_xwii_balance},
+  {"xwii_sticks", l_xwii_sticks},
+  {"xwii_record", l_xwii_record},
+  {"xwii_latency", l_xwii_latency},
+  {"xwii_latency_stats", l_xwii_latency_stats},
+  {"xwii_latency_dump", l_xwii_latency_dump},
+  {NULL, NULL}  /* sentinel */
+};
+
+// Make sure that the reader thread is stopped and the device registry is
+// freed before the module gets unloaded. This is invoked through a sentinel
+// object in the Lua registry when the Lua state is closed.
+static int l_xwii_shutdown(lua_State *L)
+{
+  reader_stop();
+  registry_free();
+  return 0;
+}
+
+// Methods of device handles. These are just the functions above which take
+// a device handle as their first argument.
+static const struct luaL_Reg devmethods [] = {
+  {"close", l_xwii_close},
+  {"path", l_xwii_path},
+  {"info", l_xwii_info},
+  {"get_battery", l_xwii_get_battery},
+  {"get_leds", l_xwii_get_leds},
+  {"set_leds", l_xwii_set_leds},
+  {"rumble", l_xwii_rumble},
+  {"poll", l_xwii_poll},
+  {"poll_all", l_xwii_poll_all},
+  {"wait", l_xwii_wait},
+  {"accel", l_xwii_accel},
+  {"ir", l_xwii_ir},
+  {"motion_plus", l_xwii_motion_plus},
+  {"nunchuk_accel", l_xwii_nunchuk_accel},
+  {"nunchuk_stick", l_xwii_nunchuk_stick},
+  {"pro_stick", l_xwii_pro_stick},
+  {"classic", l_xwii_classic},
+  {"board", l_xwii_board},
+  {"guitar", l_xwii_guitar},
+  {"drums", l_xwii_drums},
+  {"age", l_xwii_age},
+  {"history_size", l_xwii_history_size},
+  {"history", l_xwii_history},
+  {"snapshot", l_xwii_snapshot},
+  {"fusion", l_xwii_fusion},
+  {"orientation", l_xwii_orientation},
+  {"calibrate", l_xwii_calibrate},
+  {"calib_save", l_xwii_calib_save},
+  {"calib_load", l_xwii_calib_load},
+  {"filter", l_xwii_filter},
+  {"ir_tracking", l_xwii_ir_tracking},
+  {"pointer", l_xwii_pointer},
+  {"gestures", l_xwii_gestures},
+  {"gesture_add", l_xwii_gesture_add},
+  {"gesture_record", l_xwii_gesture_record},
+  {"trigger", l_xwii_trigger},
+  {"resample", l_xwii_resample},
+  {"frames", l_xwii_frames},
+  {"balance_setup", l_xwii_balance_setup},
+  {"balance", l_xwii_balance},
+  {"sticks", l_xwii_sticks},
+  {"record", l_xwii_record},
+  {"latency", l_xwii_latency},
+  {"latency_stats", l_xwii_latency_stats},
+  {"latency_dump", l_xwii_latency_dump},
   {NULL, NULL}  /* sentinel */
 };
 
 int luaopen_xwiilua (lua_State *L) {
+  int i;
+  luaL_newmetatable(L, DEVHANDLE);
+  luaL_newlib(L, devmethods);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, l_xwii_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pushcfunction(L, l_xwii_gc);
+  lua_setfield(L, -2, "__close");
+  lua_pushcfunction(L, l_xwii_tostring);
+  lua_setfield(L, -2, "__tostring");
+  lua_pop(L, 1);
+  lua_newuserdata(L, 1);
+  lua_newtable(L);
+  lua_pushcfunction(L, l_xwii_shutdown);
+  lua_setfield(L, -2, "__gc");
+  lua_setmetatable(L, -2);
+  lua_setfield(L, LUA_REGISTRYINDEX, "xwiilua.sentinel");
   luaL_newlib(L, xwiilua);
+  // sensor bitmasks for xwii_snapshot
+  lua_createtable(L, 0, NSENSORS);
+  for (i = 0; i < NSENSORS; i++) {
+    lua_pushinteger(L, 1<<i);
+    lua_setfield(L, -2, sensor_names[i]);
+  }
+  lua_setfield(L, -2, "xwii_sensors");
+  // base codes of the synthetic key events reported by xwii_poll
+  lua_createtable(L, 0, 3);
+  lua_pushinteger(L, CODE_GESTURE);
+  lua_setfield(L, -2, "gesture");
+  lua_pushinteger(L, CODE_TRIGGER);
+  lua_setfield(L, -2, "trigger");
+  lua_pushinteger(L, CODE_DRUM);
+  lua_setfield(L, -2, "drum");
+  lua_setfield(L, -2, "xwii_codes");
   return 1;
 }